@@ -0,0 +1,272 @@
+// Benchmark driver of the K-means++ color quantization library
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "ciq.h"
+
+#define RUNS 5          // default number of measured runs per case
+#define WARMUP 1        // default number of runs discarded per case
+#define PHASES 6
+
+// KCIQ: Define the phases reported for every case
+static const char * phases[PHASES] = { "load", "seed", "assign", "update", "remap", "total" };
+
+// KCIQ: Define the images of the benchmark
+typedef struct image {
+    char name[64];
+    unsigned char * rgb;
+    int width, height;
+} Image;
+
+// KCIQ: Define the median and 95th percentile of a phase, in milliseconds
+typedef struct timing {
+    double median, p95;
+} Timing;
+
+// KCIQ: parse a whole decimal number within [lo, hi]
+static bool ciq_number(const char * text, long lo, long hi, int * value) {
+    char * end;
+    long number = strtol(text, &end, 10);
+    if (end == text || *end || number < lo || number > hi)
+        return false;
+    *value = (int) number;
+    return true;
+}
+
+// KCIQ: read a binary PPM file, NULL if missing or unsupported
+static unsigned char * ciq_read_ppm(const char * filename, int * width, int * height) {
+    FILE * file = fopen(filename, "rb");
+    int maxval;
+    if (!file) return NULL;
+    if (fscanf(file, "P6 %d %d %d", width, height, &maxval) != 3 ||
+        *width <= 0 || *height <= 0 || maxval != 255 || fgetc(file) == EOF) {
+        fclose(file);
+        return NULL;
+    }
+    size_t size = 3 * (size_t) *width * *height;
+    unsigned char * rgb = (unsigned char *) malloc(size);
+    if (rgb && fread(rgb, 1, size, file) != size) {
+        free(rgb);
+        rgb = NULL;
+    }
+    fclose(file);
+    return rgb;
+}
+
+// KCIQ: generate a photo-like image, smooth gradients with some noise
+static unsigned char * ciq_synthetic(int width, int height) {
+    unsigned char * rgb = (unsigned char *) malloc(3 * (size_t) width * height);
+    unsigned int state = 12345;
+    if (!rgb) return NULL;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            unsigned char * p = rgb + 3 * ((size_t) y * width + x);
+            state = state * 1103515245 + 12345;
+            int noise = (int) (state >> 16) % 17 - 8;
+            int r = 255 * x / width + noise;
+            int g = 255 * y / height - noise;
+            int b = (128 + (x * y / 64 + x / 3) % 128) + noise;
+            p[0] = (unsigned char) (r < 0 ? 0 : r > 255 ? 255 : r);
+            p[1] = (unsigned char) (g < 0 ? 0 : g > 255 ? 255 : g);
+            p[2] = (unsigned char) (b < 0 ? 0 : b > 255 ? 255 : b);
+        }
+    }
+    return rgb;
+}
+
+// KCIQ: sort doubles in ascending order
+static int ciq_compare_time(const void * a, const void * b) {
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+// KCIQ: median and nearest-rank 95th percentile of n samples, sorted in place
+static Timing ciq_summarize(double * samples, int n) {
+    Timing t;
+    qsort(samples, n, sizeof(double), ciq_compare_time);
+    t.median = n % 2 ? samples[n / 2] : 0.5 * (samples[n / 2 - 1] + samples[n / 2]);
+    int rank = (95 * n + 99) / 100;
+    t.p95 = samples[rank > 0 ? rank - 1 : 0];
+    return t;
+}
+
+// KCIQ: time one quantization, samples receives the phases in milliseconds
+// Every run starts from the seed of the options, so the runs do the same work.
+static bool ciq_run(const Image * image, const CiqOptions * opts, unsigned char * output,
+                    double * samples, int * iterations) {
+    CiqStats s;
+    double start = ciq_seconds();
+    CiqContext * ctx = ciq_init(image->rgb, image->width, image->height, opts);
+    if (!ctx) return false;
+    bool done = ciq_quantize(ctx) && ciq_render(ctx, output) && ciq_stats(ctx, &s);
+    double total = ciq_seconds() - start;
+    ciq_shutdown(ctx);
+    if (!done) return false;
+
+    samples[0] = 1000 * s.load;
+    samples[1] = 1000 * s.seeding;
+    samples[2] = 1000 * s.assignment;
+    samples[3] = 1000 * s.update;
+    samples[4] = 1000 * s.remap;
+    samples[5] = 1000 * total;
+    *iterations = s.passes;
+    return true;
+}
+
+// KCIQ: run a case with warmup and report it as a CSV line or a JSON object
+static bool ciq_bench(const Image * image, const CiqOptions * opts, int runs, int warmup,
+                      bool json, bool first) {
+    double * samples = (double *) malloc((PHASES + 1) * runs * sizeof(double));
+    double * series = samples + PHASES * runs;
+    double run[PHASES];
+    unsigned char * output = (unsigned char *) malloc(3 * (size_t) image->width * image->height);
+    Timing t[PHASES];
+    int iterations = 0;
+    bool done = samples && output;
+
+    for (int i = -warmup; done && i < runs; i++) {
+        done = ciq_run(image, opts, output, run, &iterations);
+        for (int p = 0; done && i >= 0 && p < PHASES; p++)
+            samples[p * runs + i] = run[p];
+    }
+    if (done) {
+        for (int p = 0; p < PHASES; p++) {
+            memcpy(series, samples + p * runs, runs * sizeof(double));
+            t[p] = ciq_summarize(series, runs);
+        }
+        double pixels = (double) image->width * image->height;
+        double mps = t[5].median > 0 ? pixels / 1000.0 / t[5].median : 0;
+
+        if (json) {
+            printf("%s  {\"image\":\"%s\",\"width\":%d,\"height\":%d,\"K\":%d,\"iterations\":%d",
+                   first ? "" : ",\n", image->name, image->width, image->height, opts->K, iterations);
+            printf(",\"algorithm\":\"%s\",\"init\":\"%s\",\"threads\":%d,\"histogram\":%s,\"lut\":%d",
+                   ciq_algorithm_name(opts->algorithm), ciq_seeding_name(opts->seeding), opts->threads,
+                   opts->histogram ? "true" : "false", opts->lut);
+            for (int p = 0; p < PHASES; p++)
+                printf(",\"%s_ms\":{\"median\":%.3f,\"p95\":%.3f}", phases[p], t[p].median, t[p].p95);
+            printf(",\"mpixels_per_s\":%.3f}", mps);
+        }
+        else {
+            printf("%s,%d,%d,%d,%d", image->name, image->width, image->height, opts->K, iterations);
+            printf(",%s,%s,%d,%d,%d", ciq_algorithm_name(opts->algorithm), ciq_seeding_name(opts->seeding),
+                   opts->threads, opts->histogram, opts->lut);
+            for (int p = 0; p < PHASES; p++)
+                printf(",%.3f,%.3f", t[p].median, t[p].p95);
+            printf(",%.3f\n", mps);
+        }
+        fflush(stdout);
+    }
+    else
+        fprintf(stderr, "Failed to benchmark %s with K=%d\n", image->name, opts->K);
+
+    free(samples);
+    free(output);
+    return done;
+}
+
+int main(int argc, char *argv[]) {
+    const char * bundled[] = { "ginko", "maple", "pepper", "willow", "f35" };
+    const int sizes[][2] = { { 640, 480 }, { 1280, 720 }, { 1920, 1080 } };
+    int ks[16] = { 16, 64, 256 }, nk = 0;
+    int runs = RUNS, warmup = WARMUP;
+    bool json = false, synthetic = true;
+    Image images[8];
+    int count = 0;
+
+    CiqOptions opts;
+    ciq_options(&opts);
+    bool invalid = false;
+    for (int i = 1; !invalid && i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            invalid = !ciq_number(argv[++i], 0, INT_MAX, &opts.threads);
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            invalid = !ciq_number(argv[++i], 1, INT_MAX, &runs);
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc)
+            invalid = !ciq_number(argv[++i], 0, INT_MAX, &warmup);
+        else if (strcmp(argv[i], "--json") == 0)
+            json = true;
+        else if (strcmp(argv[i], "--bundled") == 0)
+            synthetic = false;
+        else if (strcmp(argv[i], "--histogram") == 0)
+            opts.histogram = true;
+        else if (strcmp(argv[i], "--lut") == 0 && i + 1 < argc) {
+            opts.lut = atoi(argv[++i]);
+            if (opts.lut != 0 && (opts.lut < CIQ_MIN_LUT || opts.lut > CIQ_MAX_LUT)) {
+                fprintf(stderr, "The inverse colormap needs %d to %d bits per channel\n",
+                        CIQ_MIN_LUT, CIQ_MAX_LUT);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            if (!ciq_parse_algorithm(argv[++i], &opts.algorithm)) {
+                fprintf(stderr, "Unknown algorithm %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--init") == 0 && i + 1 < argc) {
+            if (!ciq_parse_seeding(argv[++i], &opts.seeding)) {
+                fprintf(stderr, "Unknown initialization %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (nk < 16 && argv[i][0] != '-')
+            invalid = !ciq_number(argv[i], 1, CIQ_MAX_K, &ks[nk++]);
+        else
+            invalid = true;
+    }
+    if (invalid) {
+        fprintf(stderr, "Usage: %s [-j threads] [-r runs] [-w warmup] [-a lloyd|elkan|kdtree|yinyang] [--init kmeans++|kmeans|||afkmc2] [--lut bits] [--histogram] [--bundled] [--json] [K...]\n", argv[0]);
+        fprintf(stderr, "       threads >= 0, runs >= 1, warmup >= 0, 1 <= K <= %d\n", CIQ_MAX_K);
+        return 1;
+    }
+    if (nk == 0) nk = 3;
+
+    // bundled images, then synthetic ones of growing size
+    for (int i = 0; i < 5; i++) {
+        char filename[64];
+        Image * image = &images[count];
+        sprintf(filename, "%s.ppm", bundled[i]);
+        image->rgb = ciq_read_ppm(filename, &image->width, &image->height);
+        if (!image->rgb) {
+            fprintf(stderr, "Skipping missing image %s\n", filename);
+            continue;
+        }
+        strcpy(image->name, bundled[i]);
+        count++;
+    }
+    for (int i = 0; synthetic && i < 3; i++) {
+        Image * image = &images[count];
+        image->width = sizes[i][0];
+        image->height = sizes[i][1];
+        image->rgb = ciq_synthetic(image->width, image->height);
+        if (!image->rgb) continue;
+        sprintf(image->name, "synthetic-%dx%d", image->width, image->height);
+        count++;
+    }
+
+    if (json)
+        printf("[\n");
+    else {
+        printf("image,width,height,K,iterations,algorithm,init,threads,histogram,lut");
+        for (int p = 0; p < PHASES; p++)
+            printf(",%s_median_ms,%s_p95_ms", phases[p], phases[p]);
+        printf(",mpixels_per_s\n");
+    }
+
+    bool done = true, first = true;
+    for (int i = 0; i < count; i++) {
+        for (int k = 0; k < nk; k++) {
+            opts.K = ks[k];
+            if (ciq_bench(&images[i], &opts, runs, warmup, json, first))
+                first = false;
+            else
+                done = false;
+        }
+        free(images[i].rgb);
+    }
+    if (json)
+        printf("\n]\n");
+    return done ? 0 : 1;
+}
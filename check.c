@@ -0,0 +1,213 @@
+// Checks of the K-means++ color quantization library internals
+// The library is compiled in, so its static functions can be called directly.
+#include "ciq.c"
+
+#define TRIALS 20000    // seedings drawn per path
+#define TOLERANCE 0.02  // largest gap between the frequencies of a color, about 4 sigma
+#define WIDTH 128       // size of the generated image
+#define HEIGHT 96
+#define PALETTE 16      // colors of the generated image
+
+// KCIQ: Define the colors of the seeding check and their pixel counts
+static const Pixel colors[3] = { { 0, 0, 0, 0 }, { 255, 0, 0, 0 }, { 0, 0, 255, 0 } };
+static const long counts[3] = { 500, 499, 1 };
+
+// KCIQ: count how often each color is the second AFK-MC² seed
+// The first seed is the most common color, so the rare one should only be
+// picked in proportion to its single pixel.
+static bool ciq_check_seeds(const Pixel * data, const long * weights, long count, long * picked) {
+    Arena arena;
+    Random random;
+    Centroid centroids[2];
+    bool ok = true;
+    memset(&arena, 0, sizeof(Arena));
+
+    for (int t = 0; ok && t < TRIALS; t++) {
+        ciq_random_seed(&random, t + 1);
+        centroids[0] = (Centroid){ colors[0].r, colors[0].g, colors[0].b };
+        ok = ciq_afkmc2(NULL, &arena, &random, data, weights, count, centroids, 2, CHAIN, 0);
+        for (int c = 0; ok && c < 3; c++)
+            if (centroids[1].r == colors[c].r && centroids[1].g == colors[c].g &&
+                centroids[1].b == colors[c].b)
+                picked[c]++;
+    }
+    ciq_arena_free(&arena);
+    return ok;
+}
+
+// KCIQ: the unique colors, weighted by their pixels, seed like the pixels
+static bool ciq_check_afkmc2(void) {
+    Pixel pixels[1000];
+    long pixel_picks[3] = { 0 }, color_picks[3] = { 0 };
+    long n = 0;
+    for (int c = 0; c < 3; c++)
+        for (long j = 0; j < counts[c]; j++)
+            pixels[n++] = colors[c];
+
+    if (!ciq_check_seeds(pixels, NULL, n, pixel_picks) ||
+        !ciq_check_seeds(colors, counts, 3, color_picks)) {
+        fprintf(stderr, "afkmc2: seeding failed\n");
+        return false;
+    }
+    bool ok = true;
+    for (int c = 0; c < 3; c++) {
+        double pixel = (double) pixel_picks[c] / TRIALS, color = (double) color_picks[c] / TRIALS;
+        if (fabs(pixel - color) > TOLERANCE) {
+            fprintf(stderr, "afkmc2: color %d seeded %.4f of the time from the pixels, %.4f from the histogram\n",
+                    c, pixel, color);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// KCIQ: generate a small photo-like image, smooth gradients with some noise
+static unsigned char * ciq_check_image(int width, int height) {
+    unsigned char * rgb = (unsigned char *) malloc(3 * (size_t) width * height);
+    unsigned int state = 12345;
+    if (!rgb) return NULL;
+    for (long i = 0; i < (long) width * height; i++) {
+        int x = (int) (i % width), y = (int) (i / width);
+        state = state * 1103515245 + 12345;
+        int noise = (int) (state >> 16) % 17 - 8;
+        int c[3] = { 255 * x / width + noise, 255 * y / height - noise, 128 + (x * y / 8) % 128 + noise };
+        for (int k = 0; k < 3; k++)
+            rgb[3 * i + k] = (unsigned char) (c[k] < 0 ? 0 : c[k] > 255 ? 255 : c[k]);
+    }
+    return rgb;
+}
+
+// KCIQ: Define the algorithms and thread counts checked against serial Lloyd
+static const CiqAlgorithm algorithms[] = { CIQ_LLOYD, CIQ_ELKAN, CIQ_KDTREE, CIQ_YINYANG };
+static const int threads[] = { 1, 2, 4 };
+
+// KCIQ: quantize rgb through a context that first quantized another image
+// ciq_reload must leave nothing of the first image behind.
+static bool ciq_check_reload(const unsigned char * rgb, const CiqOptions * opts,
+                             unsigned char * palette, unsigned char * indices) {
+    unsigned char * other = ciq_check_image(WIDTH / 2, HEIGHT / 2);
+    CiqContext * ctx = other ? ciq_init(other, WIDTH / 2, HEIGHT / 2, opts) : NULL;
+    bool ok = ctx && ciq_quantize(ctx) && ciq_reload(ctx, rgb, WIDTH, HEIGHT) &&
+              ciq_quantize(ctx) && ciq_palette(ctx, palette) == opts->K && ciq_indices(ctx, indices);
+    ciq_shutdown(ctx);
+    free(other);
+    return ok;
+}
+
+// KCIQ: every algorithm, thread count and reloaded context gives the labels of serial Lloyd
+// The accelerated algorithms only skip distances that cannot change a label.
+static bool ciq_check_algorithms(void) {
+    unsigned char * rgb = ciq_check_image(WIDTH, HEIGHT);
+    unsigned char expected[3 * PALETTE], palette[3 * PALETTE];
+    unsigned char * labels = (unsigned char *) malloc(2 * WIDTH * HEIGHT), * indices = labels + WIDTH * HEIGHT;
+    CiqOptions opts;
+    ciq_options(&opts);
+    opts.K = PALETTE;
+    opts.threads = 1;
+    bool ok = rgb && labels && ciq_quantize_rgb(rgb, WIDTH, HEIGHT, &opts, expected, labels);
+    if (!ok)
+        fprintf(stderr, "algorithms: serial Lloyd failed\n");
+
+    for (size_t a = 0; ok && a < sizeof(algorithms) / sizeof(algorithms[0]); a++) {
+        opts.algorithm = algorithms[a];
+        for (size_t t = 0; t <= sizeof(threads) / sizeof(threads[0]); t++) {
+            bool reload = t == sizeof(threads) / sizeof(threads[0]);
+            opts.threads = reload ? 1 : threads[t];
+            bool done = reload ? ciq_check_reload(rgb, &opts, palette, indices)
+                               : ciq_quantize_rgb(rgb, WIDTH, HEIGHT, &opts, palette, indices);
+            if (!done || memcmp(palette, expected, sizeof(palette)) != 0 ||
+                memcmp(indices, labels, WIDTH * HEIGHT) != 0) {
+                if (reload)
+                    fprintf(stderr, "algorithms: %s after a reload gave other labels than serial Lloyd\n",
+                            ciq_algorithm_name(opts.algorithm));
+                else
+                    fprintf(stderr, "algorithms: %s with -j %d gave other labels than serial Lloyd\n",
+                            ciq_algorithm_name(opts.algorithm), opts.threads);
+                ok = false;
+            }
+        }
+    }
+    free(labels);
+    free(rgb);
+    return ok;
+}
+
+#ifdef CIQ_THREADS
+#define LENDERS 6       // threads lent to a pool declaring POOL_THREADS
+#define CALLERS 4       // contexts quantizing on their own threads
+#define POOL_THREADS 2
+
+// KCIQ: Define a context quantizing the image on its own thread
+typedef struct caller {
+    const unsigned char * rgb;
+    const unsigned char * expected;
+    CiqOptions opts;
+    bool ok;
+} Caller;
+
+static void * ciq_check_lender(void * arg) {
+    ciq_pool_serve((CiqPool *) arg);
+    return NULL;
+}
+
+static void * ciq_check_caller(void * arg) {
+    Caller * c = (Caller *) arg;
+    unsigned char palette[3 * 16], indices[WIDTH * HEIGHT];
+    c->ok = ciq_quantize_rgb(c->rgb, WIDTH, HEIGHT, &c->opts, palette, indices) &&
+            memcmp(indices, c->expected, sizeof(indices)) == 0;
+    return NULL;
+}
+
+// KCIQ: a shared pool given more threads than it declares keeps the labels
+// The threads beyond the declared count must not take a replica of the sums.
+static bool ciq_check_pool(void) {
+    unsigned char * rgb = ciq_check_image(WIDTH, HEIGHT);
+    unsigned char palette[3 * 16], expected[WIDTH * HEIGHT];
+    pthread_t lenders[LENDERS], callers[CALLERS];
+    Caller c[CALLERS];
+    CiqOptions opts;
+    bool ok = rgb != NULL;
+
+    ciq_options(&opts);
+    opts.K = 16;
+    ok = ok && ciq_quantize_rgb(rgb, WIDTH, HEIGHT, &opts, palette, expected);
+    opts.pool = ok ? ciq_pool_create(POOL_THREADS, true) : NULL;
+    int lent = 0, called = 0;
+    while (opts.pool && lent < LENDERS &&
+           pthread_create(&lenders[lent], NULL, ciq_check_lender, opts.pool) == 0)
+        lent++;
+    while (opts.pool && called < CALLERS) {
+        c[called] = (Caller){ rgb, expected, opts, false };
+        if (pthread_create(&callers[called], NULL, ciq_check_caller, &c[called]) != 0)
+            break;
+        called++;
+    }
+    for (int i = 0; i < called; i++) {
+        pthread_join(callers[i], NULL);
+        if (!c[i].ok) {
+            fprintf(stderr, "pool: context %d on a shared pool gave other labels\n", i);
+            ok = false;
+        }
+    }
+    if (opts.pool) {
+        ciq_pool_stop(opts.pool);
+        for (int i = 0; i < lent; i++)
+            pthread_join(lenders[i], NULL);
+        ciq_pool_destroy(opts.pool);
+    }
+    ok = ok && opts.pool && called == CALLERS;
+    free(rgb);
+    return ok;
+}
+#endif
+
+int main(void) {
+    ciq_select_kernel();
+    bool ok = ciq_check_afkmc2();
+    ok = ciq_check_algorithms() && ok;
+#ifdef CIQ_THREADS
+    ok = ciq_check_pool() && ok;
+#endif
+    printf("%s\n", ok ? "All checks passed" : "Some checks failed");
+    return ok ? 0 : 1;
+}
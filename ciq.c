@@ -2,263 +2,2829 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
+#include "ciq.h"
+
+// KCIQ: short names of the public types inside the library
+typedef CiqAlgorithm Algorithm;
+typedef CiqSeeding Seeding;
+typedef CiqPool Pool;
+typedef CiqOptions Options;
+typedef CiqContext Context;
+typedef CiqPass Pass;
+typedef CiqStats Stats;
 
 // Uncomment the following line to enable debug mode
 // #define __DEBUG__
-#define MAX_ITERS 100   // maximum number of iterations
-#define EPSILON 8       // threshold for centroid update
+#define MAX_ITERS 100   // default maximum number of iterations
+#define EPSILON 8       // default threshold for centroid update
+#define CHUNK_SIZE 4096 // number of data points per scheduled chunk
+
+// KCIQ: worker threads are available everywhere but on DOS
+#if !defined(__DJGPP__) && !defined(CIQ_NO_THREADS)
+    #define CIQ_THREADS
+    #include <pthread.h>
+    #include <unistd.h>
+#endif
+
+// KCIQ: SSE4.1/AVX2 kernels are compiled in on x86 and selected at runtime
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && \
+    !defined(__DJGPP__) && !defined(CIQ_NO_SIMD)
+    #define CIQ_SIMD
+    #include <immintrin.h>
+#endif
+#define LANES 8         // centroids are padded to a multiple of the widest kernel
+#define FAR 1.0e6f      // coordinate of the padding centroids, never the nearest
+
+#define SLACK 1.0e-3f   // margin keeping the Elkan bounds safe from rounding errors
+#define REBASE 1024.0f  // rebase the Elkan lower bounds before losing float precision
+#define GROUP_SIZE 10   // centroids per Yinyang group
+#define LEAF_SIZE 8     // maximum number of data points in a kd-tree leaf
+#define MAX_DEPTH 24    // kd-tree depth bound, 8 halvings per channel reach a single color
+#define MAX_K CIQ_MAX_K  // labels are stored on at most 16 bits
+#define ROUNDS 5        // k-means|| sampling rounds
+#define OVERSAMPLING 0.5    // k-means|| candidates expected per round, times K
+#define RECLUSTER 10    // Lloyd iterations over the weighted k-means|| candidates
+#define CHAIN 200       // default length of the AFK-MC² Markov chains
+#define BATCHES 100     // default number of mini-batches
+#define LUT_BITS 6      // bits per channel of the inverse colormap built by ciq_map
+#define MIN_LUT CIQ_MIN_LUT  // smallest inverse colormap, 16 cells per channel
+#define MAX_LUT CIQ_MAX_LUT  // largest inverse colormap, one cell per color
+#define CACHE_LINE 64   // alignment of the buffers written by several threads
+#define SEEDING_SHARE 0.5   // part of a time budget the seeding may use
+#define SEED 1          // default seed of the random generator
+
+// KCIQ: pack a color into a 24-bit integer
+#define PACK(p) ((long) (p).r << 16 | (p).g << 8 | (p).b)
+
+// KCIQ: Define structure for pixels and centroids
+typedef struct {
+    unsigned char r, g, b, x;   // packed RGBX color
+} Pixel;
+
+typedef struct {
+    int r, g, b;
+} Centroid;
+
+// KCIQ: Define a task working on the range [begin, end) of a job
+typedef void (* Task)(void * arg, long begin, long end);
+
+typedef struct job {
+    Task task;
+    void * arg;
+    long size;              // number of items to process
+    long chunk;             // number of items per chunk
+    long next;              // first item of the next chunk to hand out
+    long pending;           // number of chunks not finished yet
+    struct job * link;      // next job waiting for workers
+} Job;
+
+// KCIQ: Define the thread pool, the calling thread always takes part in a job
+// A shared pool starts no workers, its threads are lent by the callers, which
+// steal the chunks of each other's jobs while they wait for their own. At most
+// threads of them take part at once, the cluster sums have a replica for each.
+struct ciq_pool {
+    int threads;            // threads taking part in the jobs, workers and callers
+    int active;             // threads taking part right now, at most threads
+    int started;            // worker threads started by the pool
+#ifdef CIQ_THREADS
+    pthread_t * workers;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;    // signaled when a job is submitted
+    pthread_cond_t done;    // signaled when a job has finished, or submitted to a shared pool
+    Job * jobs;             // jobs with chunks left to hand out
+    bool quit;
+#endif
+};
+
+// KCIQ: Define the per-cluster sums gathered by an assignment pass
+// Each running chunk adds into its own replica, one per thread, and the
+// replicas are reduced once the pass is over. A replica keeps the four sums of
+// a cluster together, so adding a point touches half a cache line, and starts
+// on its own cache line so that the threads never share one.
+typedef struct accumulator {
+    void * block;           // allocation holding the aligned replicas
+    long * sums;            // r, g, b and pixel count per cluster, for each replica
+    long stride;            // longs per replica, 4 * K rounded up to a cache line
+    bool * busy;            // replicas held by a running chunk
+    bool * dirty;           // replicas written since they were last cleared
+    int replicas;
+    int waiting;            // chunks waiting for a replica
+    long * cluster_size;    // reduced sums, one array per channel
+    long * sum_r, * sum_g, * sum_b;
+} Accumulator;
+
+// KCIQ: Define the state of the Elkan assignment
+// The lower bounds are stored with the distance moved by their centroid
+// added, so moving a centroid does not have to touch every point.
+typedef struct elkan {
+    float * upper;          // upper bound of the distance to the assigned centroid
+    float * lower;          // lower bounds of the distances to every centroid, plus moved
+    float * moved;          // distance moved by each centroid since the bounds were rebased
+    float * drift;          // distance moved by each centroid since the last pass
+    float * between;        // half the distances between the centroids
+    float * half;           // half the distance to the closest other centroid
+    Centroid * previous;    // centroids of the last pass
+    bool ready;             // the bounds have been initialized
+} Elkan;
+
+// KCIQ: Define a kd-tree node, a box of the color cube with its cached sums
+typedef struct kdnode {
+    int lo[3], hi[3];       // bounding box of the colors in the node
+    int left, right;        // children, -1 for a leaf
+    long begin, end;        // range of the node in the order array
+    long count;             // number of pixels in the node
+    long sum[3];            // sum of the colors of the pixels in the node
+} KdNode;
+
+// KCIQ: Define the kd-tree and the per-centroid sums of the filtering
+typedef struct kdtree {
+    KdNode * nodes;
+    int size, capacity;     // number of nodes used and allocated
+    int * order;            // data point indices, grouped by node
+    int * scratch;          // candidate lists, K entries per tree level and the leaves
+    long * cluster_size;    // number of pixels assigned to each centroid
+    long * sum_r, * sum_g, * sum_b;
+    Centroid * previous;    // centroids of the last filtering pass
+    bool borrowed;          // the nodes and order belong to the tree of another context
+} KdTree;
+
+// KCIQ: Define the random generator of a context (xoshiro256**)
+// Every draw is made by the calling thread, in a fixed order, so a seed
+// gives the same palette whatever the number of threads.
+typedef struct random {
+    unsigned long long s[4];
+} Random;
+
+// KCIQ: Define the state of the k-means++ seeding
+typedef struct seeder {
+    const Pixel * data;     // points to choose the seeds from
+    const long * weights;   // weight of each point, NULL for 1
+    long count;             // number of points
+    int * mindist;          // squared distance of each point to its nearest seed
+    double * totals;        // weighted sum of mindist per chunk of points
+    Centroid seed;          // seed added last
+    Random * random;
+} Seeder;
+
+// KCIQ: Define a set of centroids for the distance kernels
+// The SIMD kernels read a single precision copy in structure-of-arrays
+// layout, padded to a multiple of LANES with centroids that are never nearest.
+typedef struct soa {
+    const Centroid * centroids;
+    int count;              // number of centroids
+    int padded;             // count rounded up to a multiple of LANES
+    float * r, * g, * b;
+} Soa;
+
+// KCIQ: Define the state of the Yinyang assignment
+// The centroids are clustered into groups of about GROUP_SIZE, and a point
+// keeps one lower bound per group, the distance to the nearest centroid of
+// the group it is not assigned to, instead of one per centroid.
+typedef struct yinyang {
+    float * upper;          // upper bound of the distance to the assigned centroid
+    float * lower;          // lower bounds of the distances to each group
+    float * drift;          // distance moved by each centroid since the last pass
+    float * spread;         // largest drift of each group
+    int * group;            // group of each centroid
+    int * member;           // centroids sorted by group
+    int * first;            // first member of each group, and the end of the last one
+    int groups;
+    int rows, width;        // members of the largest group, groups rounded up to LANES
+    float * r, * g, * b;    // member m of group g at m * width + g, padded with FAR
+    long cells;             // capacity of r, g and b
+    Centroid * previous;    // centroids of the last pass
+    bool ready;             // the groups and bounds have been initialized
+} Yinyang;
+
+// KCIQ: Define the proposal distribution of the AFK-MC² seeding
+typedef struct proposal {
+    const Pixel * data;     // points to choose the seeds from
+    const long * weights;   // weight of each point, NULL for 1
+    long count;             // number of points
+    Centroid first;         // first seed
+    double * distance;      // running sums of the weighted distances to the first seed, per chunk
+    double * weight;        // running sums of the weights per chunk, NULL for unit weights
+    double * dtotals;       // prefix sums of the chunk distance totals
+    double * wtotals;       // prefix sums of the chunk weight totals
+    double distance_sum, weight_sum;
+} Proposal;
+
+// KCIQ: Define the state of the k-means|| sampling rounds
+typedef struct sampler {
+    Seeder * seeder;        // points, weights and distances to the nearest candidate
+    Soa soa;                // candidates added by the last round
+    long first;             // index of the first of these candidates
+    int * nearest;          // nearest candidate of each point
+    Pool * pool;
+    double factor;          // selection probability per unit of weighted distance
+    unsigned long long key; // random key of the round
+    long * picked;          // points selected by the round
+    long count, capacity;   // number of points selected and allocated
+    double deadline;        // the passes after the first one skip their chunks past it
+} Sampler;
+
+// KCIQ: Define the state of the mini-batch k-means
+typedef struct minibatch {
+    long * points;          // data points of the current batch
+    int * nearest;          // nearest centroid of each point of the batch
+    double * centers;       // centroids in full precision, r, g, b per centroid
+    long * seen;            // points assigned to each centroid, inverse of its learning rate
+} MiniBatch;
+
+// KCIQ: Define an inverse colormap, the nearest palette entry of each cell
+// of a grid over the color cube, so any color maps with a single lookup
+typedef struct lut {
+    int bits;               // bits per channel of the grid
+    unsigned short * entry; // palette entry of each cell
+    int * distance;         // squared distance of each cell center to its entry
+    const Centroid * palette;
+    int K;                  // number of palette entries
+} Lut;
+
+// KCIQ: Define the buffers a context keeps from one image to the next
+typedef enum {
+    SLOT_PIXELS,            // pixels of the image
+    SLOT_LABELS,            // cluster of each data point
+    SLOT_COLORS,            // unique colors in histogram mode
+    SLOT_WEIGHTS,           // pixels per unique color
+    SLOT_INDEX,             // unique color of each pixel
+    SLOT_ORDER,             // radix sort of the histogram
+    SLOT_SORTED,
+    SLOT_TREE,              // data points grouped by kd-tree node
+    SLOT_UPPER,             // Elkan or Yinyang bounds
+    SLOT_LOWER,
+    SLOT_DISTANCES,         // seeding distance of each data point
+    SLOT_RUNNING,           // AFK-MC² running sums of the weights
+    SLOT_NEAREST,           // k-means|| candidate nearest to each data point
+    SLOT_TOTALS,            // seeding sums per chunk of data points
+    SLOT_PASSES,            // statistics of each iteration
+    SLOT_POINTS,            // centroids clustered into the Yinyang groups
+    SLOT_POINT_WEIGHTS,
+    SLOT_CENTERS,           // centers of the Yinyang groups
+    SLOT_RECLUSTER_SUMS,    // cluster sums of ciq_recluster
+    SLOT_RECLUSTER_DISTANCES,   // seeding distance of each reclustered point
+    SLOT_RECLUSTER_TOTALS,
+    SLOT_RECLUSTER_LAYOUT,  // kernel layout of the reclustered centroids
+    SLOTS
+} Slot;
+
+// KCIQ: Define the arena of a context, a buffer per slot that only grows
+// Quantizing images of the same size again does not allocate anything.
+typedef struct arena {
+    void * data[SLOTS];
+    size_t capacity[SLOTS]; // bytes allocated per slot
+} Arena;
+
+struct ciq_context {
+    int width, height;
+    long size;
+    int K;
+    Pixel * pixels;
+    Centroid * centroids;
+    Pixel * data;           // points being clustered, the pixels or the unique colors
+    long * weights;         // number of pixels per data point, NULL for the pixels
+    long count;             // number of data points
+    void * labels;          // cluster of each data point, 8 bits up to K=256 else 16 bits
+    int label_size;         // size of a label in bytes
+    Pixel * colors;         // unique colors of the image in histogram mode
+    int * index;            // color index of each pixel in histogram mode
+    Soa soa;                // centroids in the layout of the distance kernels
+    Algorithm algorithm;    // assignment algorithm of the current image
+    Algorithm requested;    // assignment algorithm of the options
+    Seeding seeding;
+    int chain;
+    long batch;
+    int batches;
+    bool histogram;         // cluster the unique colors instead of the pixels
+    bool labeled;           // every data point has been assigned to the final centroids
+    MiniBatch * minibatch;
+    int lut_bits;
+    Lut * lut;              // inverse colormap of the final palette
+    Accumulator acc;        // cluster sums of the last assignment pass
+    Arena arena;            // buffers kept across ciq_reload
+    bool lut_ready;         // the inverse colormap matches the palette
+    bool verbose;
+    Elkan * elkan;
+    Yinyang * yinyang;
+    KdTree * kdtree;
+    long evaluations;       // distances computed by the last assignment pass
+    int budget;             // milliseconds for ciq_quantize and ciq_finish, 0 for none
+    int iterations;         // maximum number of iterations
+    int tolerance;          // squared shift under which a centroid has not moved
+    double improvement;     // relative SSE decrease under which the clusters are stable
+    double energy;          // weighted sum of the squared norms of the points
+    double sse;             // sum of squared errors of the last assignment to its means
+    long changed;           // points reassigned by the last assignment pass, -1 if unknown
+    int empty;              // clusters left empty by the last update
+    bool assigned;          // the labels hold the previous assignment pass
+    Stats stats;            // timings and counters of the image
+    unsigned long seed;     // seed of the random generator for each image
+    Random random;
+    Pass * passes;          // statistics of each iteration
+    int restarts;           // independent seedings, the lowest SSE is kept
+    Context ** runs;        // contexts of the restarts, the first one is this one
+    double deadline;        // ciq_seconds() time by which the palette must be usable
+    double distance_time;   // seconds per distance, measured for the deadline
+    Pool * pool;
+    bool shared;            // the pool belongs to the caller
+};
+
+// KCIQ: Define a kernel returning the nearest centroid to a color and its distance
+typedef int (* Nearest)(const Soa * s, int r, int g, int b, long * distance);
+
+// KCIQ: Define a kernel writing the squared distance from a color to each Yinyang group
+typedef void (* Groups)(const Yinyang * y, int r, int g, int b, float * distance);
+
+// KCIQ: calculate Euclidean distance
+static long ciq_distance(Centroid p1, Centroid p2) {
+    long dr = p1.r - p2.r;
+    long dg = p1.g - p2.g;
+    long db = p1.b - p2.b;
+    return (dr*dr + dg*dg + db*db);
+}
+
+// KCIQ: calculate Euclidean distance between a pixel and a centroid
+static long ciq_pixel_distance(Pixel p1, Centroid p2) {
+    long dr = p1.r - p2.r;
+    long dg = p1.g - p2.g;
+    long db = p1.b - p2.b;
+    return (dr*dr + dg*dg + db*db);
+}
+
+// KCIQ: cluster of the data point i
+static int ciq_label(const Context * ctx, long i) {
+    if (ctx->label_size == 1)
+        return ((const unsigned char *) ctx->labels)[i];
+    return ((const unsigned short *) ctx->labels)[i];
+}
+
+// KCIQ: set the cluster of the data point i
+static void ciq_set_label(Context * ctx, long i, int cluster) {
+    if (ctx->label_size == 1)
+        ((unsigned char *) ctx->labels)[i] = (unsigned char) cluster;
+    else
+        ((unsigned short *) ctx->labels)[i] = (unsigned short) cluster;
+}
+
+// KCIQ: nearest centroid, portable version
+static int ciq_nearest_scalar(const Soa * s, int r, int g, int b, long * distance) {
+    Centroid p = { r, g, b };
+    long mindist = ciq_distance(p, s->centroids[0]);
+    long curdist;
+    int j, nearest = 0;
+
+    for (j = 1; j < s->count; j++) {
+        curdist = ciq_distance(p, s->centroids[j]);
+        if (curdist < mindist) {
+            mindist = curdist;
+            nearest = j;
+        }
+    }
+    *distance = mindist;
+    return nearest;
+}
+
+// KCIQ: squared distance to the nearest member of each group
+// The groups lie across the lanes, so the minimums need no reduction.
+static void ciq_groups_scalar(const Yinyang * y, int r, int g, int b, float * distance) {
+    for (int k = 0; k < y->groups; k++) {
+        float mindist = 3.0e38f;
+        for (int m = 0; m < y->rows; m++) {
+            long cell = (long) m * y->width + k;
+            float dr = y->r[cell] - r, dg = y->g[cell] - g, db = y->b[cell] - b;
+            float d = dr * dr + dg * dg + db * db;
+            if (d < mindist) mindist = d;
+        }
+        distance[k] = mindist;
+    }
+}
+
+#ifdef CIQ_SIMD
+// KCIQ: pick the lowest index among the lanes holding the minimum distance
+static int ciq_nearest_lanes(const float * dist, const int * index, int lanes, long * distance) {
+    int i, best = 0;
+    for (i = 1; i < lanes; i++) {
+        if (dist[i] < dist[best] || (dist[i] == dist[best] && index[i] < index[best]))
+            best = i;
+    }
+    *distance = (long) dist[best];
+    return index[best];
+}
+
+// KCIQ: nearest centroid, 4 centroids per instruction
+// Distances are exact in single precision (at most 3*255^2 < 2^24), so the
+// result matches the scalar kernel including ties.
+__attribute__((target("sse4.1")))
+static int ciq_nearest_sse41(const Soa * s, int r, int g, int b, long * distance) {
+    __m128 pr = _mm_set1_ps((float) r);
+    __m128 pg = _mm_set1_ps((float) g);
+    __m128 pb = _mm_set1_ps((float) b);
+    __m128 mindist = _mm_set1_ps(3.0e38f);
+    __m128i nearest = _mm_setzero_si128();
+    __m128i index = _mm_setr_epi32(0, 1, 2, 3);
+    __m128i step = _mm_set1_epi32(4);
+    float dist[4];
+    int lanes[4];
+
+    for (int j = 0; j < s->padded; j += 4) {
+        __m128 dr = _mm_sub_ps(_mm_loadu_ps(s->r + j), pr);
+        __m128 dg = _mm_sub_ps(_mm_loadu_ps(s->g + j), pg);
+        __m128 db = _mm_sub_ps(_mm_loadu_ps(s->b + j), pb);
+        __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)),
+                              _mm_mul_ps(db, db));
+        __m128 closer = _mm_cmplt_ps(d, mindist);
+        mindist = _mm_blendv_ps(mindist, d, closer);
+        nearest = _mm_blendv_epi8(nearest, index, _mm_castps_si128(closer));
+        index = _mm_add_epi32(index, step);
+    }
+
+    _mm_storeu_ps(dist, mindist);
+    _mm_storeu_si128((__m128i *) lanes, nearest);
+    return ciq_nearest_lanes(dist, lanes, 4, distance);
+}
+
+// KCIQ: nearest centroid, 8 centroids per instruction
+__attribute__((target("avx2")))
+static int ciq_nearest_avx2(const Soa * s, int r, int g, int b, long * distance) {
+    __m256 pr = _mm256_set1_ps((float) r);
+    __m256 pg = _mm256_set1_ps((float) g);
+    __m256 pb = _mm256_set1_ps((float) b);
+    __m256 mindist = _mm256_set1_ps(3.0e38f);
+    __m256i nearest = _mm256_setzero_si256();
+    __m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i step = _mm256_set1_epi32(8);
+    float dist[8];
+    int lanes[8];
+
+    for (int j = 0; j < s->padded; j += 8) {
+        __m256 dr = _mm256_sub_ps(_mm256_loadu_ps(s->r + j), pr);
+        __m256 dg = _mm256_sub_ps(_mm256_loadu_ps(s->g + j), pg);
+        __m256 db = _mm256_sub_ps(_mm256_loadu_ps(s->b + j), pb);
+        __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dr, dr), _mm256_mul_ps(dg, dg)),
+                                 _mm256_mul_ps(db, db));
+        __m256 closer = _mm256_cmp_ps(d, mindist, _CMP_LT_OQ);
+        mindist = _mm256_blendv_ps(mindist, d, closer);
+        nearest = _mm256_blendv_epi8(nearest, index, _mm256_castps_si256(closer));
+        index = _mm256_add_epi32(index, step);
+    }
+
+    _mm256_storeu_ps(dist, mindist);
+    _mm256_storeu_si256((__m256i *) lanes, nearest);
+    return ciq_nearest_lanes(dist, lanes, 8, distance);
+}
+
+// KCIQ: squared distance to each group, 4 groups per instruction
+__attribute__((target("sse4.1")))
+static void ciq_groups_sse41(const Yinyang * y, int r, int g, int b, float * distance) {
+    __m128 pr = _mm_set1_ps((float) r);
+    __m128 pg = _mm_set1_ps((float) g);
+    __m128 pb = _mm_set1_ps((float) b);
+    float dist[4];
+
+    for (int k = 0; k < y->groups; k += 4) {
+        __m128 mindist = _mm_set1_ps(3.0e38f);
+        for (long cell = k; cell < (long) y->rows * y->width; cell += y->width) {
+            __m128 dr = _mm_sub_ps(_mm_loadu_ps(y->r + cell), pr);
+            __m128 dg = _mm_sub_ps(_mm_loadu_ps(y->g + cell), pg);
+            __m128 db = _mm_sub_ps(_mm_loadu_ps(y->b + cell), pb);
+            __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dr, dr), _mm_mul_ps(dg, dg)),
+                                  _mm_mul_ps(db, db));
+            mindist = _mm_min_ps(mindist, d);
+        }
+        _mm_storeu_ps(dist, mindist);
+        memcpy(distance + k, dist, (y->groups - k < 4 ? y->groups - k : 4) * sizeof(float));
+    }
+}
+
+// KCIQ: squared distance to each group, 8 groups per instruction
+__attribute__((target("avx2")))
+static void ciq_groups_avx2(const Yinyang * y, int r, int g, int b, float * distance) {
+    __m256 pr = _mm256_set1_ps((float) r);
+    __m256 pg = _mm256_set1_ps((float) g);
+    __m256 pb = _mm256_set1_ps((float) b);
+    float dist[8];
+
+    for (int k = 0; k < y->groups; k += 8) {
+        __m256 mindist = _mm256_set1_ps(3.0e38f);
+        for (long cell = k; cell < (long) y->rows * y->width; cell += y->width) {
+            __m256 dr = _mm256_sub_ps(_mm256_loadu_ps(y->r + cell), pr);
+            __m256 dg = _mm256_sub_ps(_mm256_loadu_ps(y->g + cell), pg);
+            __m256 db = _mm256_sub_ps(_mm256_loadu_ps(y->b + cell), pb);
+            __m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dr, dr), _mm256_mul_ps(dg, dg)),
+                                     _mm256_mul_ps(db, db));
+            mindist = _mm256_min_ps(mindist, d);
+        }
+        _mm256_storeu_ps(dist, mindist);
+        memcpy(distance + k, dist, (y->groups - k < 8 ? y->groups - k : 8) * sizeof(float));
+    }
+}
+#endif
+
+// KCIQ: the distance kernels used by the clustering, see ciq_select_kernel()
+static Nearest ciq_nearest = NULL;
+static Groups ciq_groups = NULL;
+#ifdef CIQ_THREADS
+static pthread_once_t ciq_kernel_once = PTHREAD_ONCE_INIT;   // contexts may be created concurrently
+#endif
+
+// KCIQ: select the fastest distance kernel supported by the processor
+static void ciq_select_kernel(void) {
+    if (ciq_nearest) return;
+    ciq_groups = ciq_groups_scalar;
+    ciq_nearest = ciq_nearest_scalar;
+#ifdef CIQ_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        ciq_groups = ciq_groups_avx2;
+        ciq_nearest = ciq_nearest_avx2;
+    }
+    else if (__builtin_cpu_supports("sse4.1")) {
+        ciq_groups = ciq_groups_sse41;
+        ciq_nearest = ciq_nearest_sse41;
+    }
+#endif
+#ifdef __DEBUG__
+    printf("- Distance kernel: %s\n", ciq_nearest == ciq_nearest_scalar ? "scalar" :
+#ifdef CIQ_SIMD
+           ciq_nearest == ciq_nearest_avx2 ? "AVX2" : "SSE4.1");
+#else
+           "?");
+#endif
+#endif
+}
+
+// KCIQ: copy the centroids into the structure-of-arrays layout of the kernels
+static void ciq_soa_sync(Soa * s) {
+    int j;
+    for (j = 0; j < s->count; j++) {
+        s->r[j] = (float) s->centroids[j].r;
+        s->g[j] = (float) s->centroids[j].g;
+        s->b[j] = (float) s->centroids[j].b;
+    }
+    for (; j < s->padded; j++)
+        s->r[j] = s->g[j] = s->b[j] = FAR;
+}
+
+// KCIQ: allocate the kernel layout of count centroids and fill it
+static bool ciq_soa_init(Soa * s, const Centroid * centroids, int count) {
+    s->centroids = centroids;
+    s->count = count;
+    s->padded = (count + LANES - 1) / LANES * LANES;
+    s->r = (float *) malloc(3 * s->padded * sizeof(float));
+    if (!s->r) return false;
+    s->g = s->r + s->padded;
+    s->b = s->g + s->padded;
+    ciq_soa_sync(s);
+    return true;
+}
+
+// KCIQ: free the kernel layout
+static void ciq_soa_free(Soa * s) {
+    if (s->r) free(s->r);
+    s->r = NULL;
+}
+
+// KCIQ: copy the centroids of the context for the kernels
+static void ciq_sync_centroids(Context * ctx) {
+    ciq_soa_sync(&ctx->soa);
+}
+
+#ifdef CIQ_THREADS
+// KCIQ: pool the calling thread takes part in, so that nested jobs count it once
+static pthread_key_t ciq_member;
+static pthread_once_t ciq_member_once = PTHREAD_ONCE_INIT;
+
+static void ciq_member_key(void) {
+    pthread_key_create(&ciq_member, NULL);
+}
+
+// KCIQ: take the next chunk of a job, the pool must be locked
+static bool ciq_pool_take(Pool * pool, Job * job, long * begin, long * end) {
+    if (job->next >= job->size)
+        return false;
+    *begin = job->next;
+    *end = *begin + job->chunk < job->size ? *begin + job->chunk : job->size;
+    job->next = *end;
+    if (job->next >= job->size) {
+        // fully handed out, unlink the job from the queue
+        Job ** link = &pool->jobs;
+        while (*link != job)
+            link = &(*link)->link;
+        *link = job->link;
+    }
+    return true;
+}
+
+// KCIQ: run a chunk of a job and report its completion, the pool must be locked
+static void ciq_pool_run(Pool * pool, Job * job, long begin, long end) {
+    pthread_mutex_unlock(&pool->lock);
+    job->task(job->arg, begin, end);
+    pthread_mutex_lock(&pool->lock);
+    if (--job->pending == 0)
+        pthread_cond_broadcast(&pool->done);
+}
+#endif
+
+// KCIQ: take part in the jobs of the pool until it is stopped
+// A thread beyond the threads of the pool waits for another one to leave.
+void ciq_pool_serve(Pool * pool) {
+#ifdef CIQ_THREADS
+    long begin, end;
+    bool joined = false;
+
+    if (!pool) return;
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->quit && pool->threads > 1) {
+        if (!joined) {
+            if (pool->active >= pool->threads) {
+                pthread_cond_wait(&pool->done, &pool->lock);
+                continue;
+            }
+            pool->active++;
+            pthread_setspecific(ciq_member, pool);
+            joined = true;
+        }
+        Job * job = pool->jobs;
+        if (!job) {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+            continue;
+        }
+        if (ciq_pool_take(pool, job, &begin, &end))
+            ciq_pool_run(pool, job, begin, end);
+    }
+    if (joined) {
+        pool->active--;
+        pthread_setspecific(ciq_member, NULL);
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+#else
+    (void) pool;
+#endif
+}
+
+#ifdef CIQ_THREADS
+// KCIQ: worker thread main loop
+static void * ciq_pool_worker(void * arg) {
+    ciq_pool_serve((Pool *) arg);
+    return NULL;
+}
+#endif
+
+// KCIQ: create a thread pool, 0 threads means one per processor
+// Unless shared, the pool starts threads - 1 workers next to the calling
+// thread. A shared pool starts none, its callers bring the threads.
+Pool * ciq_pool_create(int threads, bool shared) {
+    Pool * pool = (Pool *) malloc(sizeof(Pool));
+    if (!pool) return NULL;
+
+#ifdef CIQ_THREADS
+    if (threads <= 0)
+        threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
+
+    pool->threads = shared ? threads : 1;
+    pool->active = 0;
+    pool->started = 0;
+    pool->jobs = NULL;
+    pool->quit = false;
+    pool->workers = (pthread_t *) malloc(threads * sizeof(pthread_t));
+    if (!pool->workers) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    pthread_once(&ciq_member_once, ciq_member_key);
+
+    // the calling thread is the first worker
+    while (!shared && pool->threads < threads) {
+        pthread_mutex_lock(&pool->lock);
+        bool started = pthread_create(&pool->workers[pool->started], NULL, ciq_pool_worker, pool) == 0;
+        if (started) {
+            pool->started++;
+            pool->threads++;
+        }
+        pthread_mutex_unlock(&pool->lock);
+        if (!started)
+            break;
+    }
+#else
+    (void) threads;
+    (void) shared;
+    pool->threads = 1;
+    pool->started = 0;
+#endif
+
+#ifdef __DEBUG__
+    printf("- Number of threads: %d\n", pool->threads);
+#endif
+    return pool;
+}
+
+// KCIQ: make the workers and the serving threads leave the pool
+void ciq_pool_stop(Pool * pool) {
+    if (!pool) return;
+#ifdef CIQ_THREADS
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_cond_broadcast(&pool->done);    // the threads waiting to take part
+    pthread_mutex_unlock(&pool->lock);
+#endif
+}
+
+// KCIQ: stop the workers and free the pool
+void ciq_pool_destroy(Pool * pool) {
+    if (!pool) return;
+#ifdef CIQ_THREADS
+    ciq_pool_stop(pool);
+    for (int i = 0; i < pool->started; i++)
+        pthread_join(pool->workers[i], NULL);
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+#endif
+    free(pool);
+}
+
+// KCIQ: run a task over [0, size) split in chunks of the given size across the pool
+// When the threads of the pool all take part already, the calling thread runs
+// the task alone without handing it to them.
+static void ciq_parallel_chunks(Pool * pool, Task task, void * arg, long size, long chunk) {
+    if (!pool || pool->threads <= 1 || size <= chunk) {
+        task(arg, 0, size);
+        return;
+    }
+
+#ifdef CIQ_THREADS
+    Job job = { task, arg, size, chunk, 0, (size + chunk - 1) / chunk, NULL };
+    long begin, end;
+
+    pthread_mutex_lock(&pool->lock);
+    Pool * outer = (Pool *) pthread_getspecific(ciq_member);
+    bool joined = outer != pool;
+    if (joined && pool->active >= pool->threads) {
+        pthread_mutex_unlock(&pool->lock);
+        task(arg, 0, size);
+        return;
+    }
+    if (joined) {
+        pool->active++;
+        pthread_setspecific(ciq_member, pool);
+    }
+    job.link = pool->jobs;
+    pool->jobs = &job;
+    pthread_cond_broadcast(&pool->wake);
+    if (pool->started < pool->threads - 1)
+        pthread_cond_broadcast(&pool->done);    // wake the callers waiting on their jobs
+
+    // help with our own job, then with the other jobs until ours is finished
+    while (ciq_pool_take(pool, &job, &begin, &end))
+        ciq_pool_run(pool, &job, begin, end);
+    while (job.pending > 0) {
+        Job * other = pool->jobs;
+        if (other && ciq_pool_take(pool, other, &begin, &end))
+            ciq_pool_run(pool, other, begin, end);
+        else
+            pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    if (joined) {
+        pool->active--;
+        pthread_setspecific(ciq_member, outer);
+        pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+#endif
+}
+
+// KCIQ: run a task over [0, size) split in chunks of data points across the pool
+static void ciq_parallel(Pool * pool, Task task, void * arg, long size) {
+    ciq_parallel_chunks(pool, task, arg, size, CHUNK_SIZE);
+}
+
+// KCIQ: serialize the chunks of a job updating shared state
+static void ciq_lock(Pool * pool) {
+#ifdef CIQ_THREADS
+    if (pool && pool->threads > 1)
+        pthread_mutex_lock(&pool->lock);
+#else
+    (void) pool;
+#endif
+}
+
+static void ciq_unlock(Pool * pool) {
+#ifdef CIQ_THREADS
+    if (pool && pool->threads > 1)
+        pthread_mutex_unlock(&pool->lock);
+#else
+    (void) pool;
+#endif
+}
+
+// KCIQ: add a value to a counter shared by the chunks of a job
+static void ciq_count(Pool * pool, long * counter, long value) {
+    ciq_lock(pool);
+    *counter += value;
+    ciq_unlock(pool);
+}
+
+// KCIQ: allocate the cluster sums, one replica per thread
+static bool ciq_acc_init(Accumulator * acc, int replicas, int K) {
+    acc->replicas = replicas;
+    acc->stride = (4L * K * sizeof(long) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE / sizeof(long);
+    acc->block = calloc(replicas * acc->stride * sizeof(long) + CACHE_LINE, 1);
+    acc->busy = (bool *) calloc(replicas, sizeof(bool));
+    acc->dirty = (bool *) calloc(replicas, sizeof(bool));
+    acc->cluster_size = (long *) malloc(4L * K * sizeof(long));
+    if (!acc->block || !acc->busy || !acc->dirty || !acc->cluster_size)
+        return false;
+    acc->sums = (long *) (((size_t) acc->block + CACHE_LINE - 1) & ~(size_t) (CACHE_LINE - 1));
+    acc->sum_r = acc->cluster_size + K;
+    acc->sum_g = acc->sum_r + K;
+    acc->sum_b = acc->sum_g + K;
+    return true;
+}
+
+// KCIQ: free the cluster sums
+static void ciq_acc_free(Accumulator * acc) {
+    if (acc->block) free(acc->block);
+    if (acc->busy) free(acc->busy);
+    if (acc->dirty) free(acc->dirty);
+    if (acc->cluster_size) free(acc->cluster_size);
+    acc->block = NULL;
+    acc->busy = acc->dirty = NULL;
+    acc->cluster_size = NULL;
+}
+
+// KCIQ: clear the cluster sums before an assignment pass
+// Only the replicas written since the last reduction need it.
+static void ciq_acc_reset(Accumulator * acc) {
+    for (int t = 0; t < acc->replicas; t++) {
+        if (acc->dirty[t])
+            memset(acc->sums + t * acc->stride, 0, acc->stride * sizeof(long));
+        acc->dirty[t] = false;
+    }
+}
+
+// KCIQ: take a free replica for a chunk, there are as many as threads
+// Should every replica be taken, the chunk waits for one to be given back.
+static long * ciq_acc_acquire(Pool * pool, Accumulator * acc) {
+    int i = 0;
+    ciq_lock(pool);
+    for (;;) {
+        for (i = 0; i < acc->replicas && acc->busy[i]; i++)
+            ;
+        if (i < acc->replicas)
+            break;
+#ifdef CIQ_THREADS
+        if (pool && pool->threads > 1) {
+            acc->waiting++;
+            pthread_cond_wait(&pool->done, &pool->lock);
+            acc->waiting--;
+            continue;
+        }
+#endif
+        i = 0;      // a single thread runs one chunk at a time, any replica will do
+        break;
+    }
+    acc->busy[i] = true;
+    acc->dirty[i] = true;
+    ciq_unlock(pool);
+    return acc->sums + i * acc->stride;
+}
+
+// KCIQ: give a replica back once the chunk is done
+static void ciq_acc_release(Pool * pool, Accumulator * acc, const long * sums) {
+    ciq_lock(pool);
+    acc->busy[(sums - acc->sums) / acc->stride] = false;
+#ifdef CIQ_THREADS
+    if (acc->waiting > 0)
+        pthread_cond_broadcast(&pool->done);
+#endif
+    ciq_unlock(pool);
+}
+
+// KCIQ: add a pixel of weight n to the sums of its cluster
+static void ciq_accumulate(long * sum, Pixel p, long n) {
+    sum[0] += n * p.r;
+    sum[1] += n * p.g;
+    sum[2] += n * p.b;
+    sum[3] += n;
+}
+
+// KCIQ: add the written replicas up into the reduced sums and clear them
+// Integer sums do not depend on the schedule. Clearing while reducing saves
+// ciq_acc_reset a second pass over the replicas.
+static void ciq_acc_reduce(Accumulator * acc, int K) {
+    memset(acc->cluster_size, 0, 4L * K * sizeof(long));
+    for (int t = 0; t < acc->replicas; t++) {
+        if (!acc->dirty[t])
+            continue;
+        long * sum = acc->sums + t * acc->stride;
+        for (int j = 0; j < K; j++, sum += 4) {
+            acc->sum_r[j] += sum[0];
+            acc->sum_g[j] += sum[1];
+            acc->sum_b[j] += sum[2];
+            acc->cluster_size[j] += sum[3];
+        }
+        memset(acc->sums + t * acc->stride, 0, acc->stride * sizeof(long));
+        acc->dirty[t] = false;
+    }
+}
+
+// KCIQ: buffer of a slot holding at least size bytes, its content is not kept
+static void * ciq_arena_get(Arena * arena, Slot slot, size_t size) {
+    if (arena->capacity[slot] < size || !arena->data[slot]) {
+        if (arena->data[slot]) free(arena->data[slot]);
+        arena->data[slot] = malloc(size > 0 ? size : 1);
+        arena->capacity[slot] = arena->data[slot] ? size : 0;
+    }
+    return arena->data[slot];
+}
+
+// KCIQ: free the buffers of the arena
+static void ciq_arena_free(Arena * arena) {
+    for (int i = 0; i < SLOTS; i++) {
+        if (arena->data[i]) free(arena->data[i]);
+        arena->data[i] = NULL;
+        arena->capacity[i] = 0;
+    }
+}
+
+// KCIQ: lay count centroids out for the kernels in a slot of an arena
+// The arena owns the layout, it is not released by ciq_soa_free.
+static bool ciq_soa_borrow(Soa * s, Arena * arena, Slot slot, const Centroid * centroids, int count) {
+    s->centroids = centroids;
+    s->count = count;
+    s->padded = (count + LANES - 1) / LANES * LANES;
+    s->r = (float *) ciq_arena_get(arena, slot, 3 * s->padded * sizeof(float));
+    if (!s->r) return false;
+    s->g = s->r + s->padded;
+    s->b = s->g + s->padded;
+    ciq_soa_sync(s);
+    return true;
+}
+
+// KCIQ: free an inverse colormap
+static void ciq_lut_free(Lut * lut) {
+    if (!lut) return;
+    if (lut->entry) free(lut->entry);
+    if (lut->distance) free(lut->distance);
+    free(lut);
+}
+
+// KCIQ: fill the cells [begin, end) of the inverse colormap
+// Every palette entry sweeps the rows of cells of the range, updating the
+// squared distance to the cell centers incrementally along the blue axis:
+// moving one cell adds 2 s (b - c) + s², which itself grows by 2 s² per cell.
+static void ciq_lut_task(void * arg, long begin, long end) {
+    Lut * lut = (Lut *) arg;
+    int side = 1 << lut->bits, step = 256 >> lut->bits, half = step / 2;
+
+    for (long cell = begin; cell < end; cell++)
+        lut->distance[cell] = 0x7fffffff;
+
+    for (int i = 0; i < lut->K; i++) {
+        Centroid c = lut->palette[i];
+        for (long row = begin; row < end; row += side) {
+            int dr = (int) (row >> 2 * lut->bits) * step + half - c.r;
+            int dg = (int) (row >> lut->bits & (side - 1)) * step + half - c.g;
+            int db = half - c.b;
+            int d = dr * dr + dg * dg + db * db;
+            int inc = step * (2 * db + step);
+            int * distance = lut->distance + row;
+            unsigned short * entry = lut->entry + row;
+            for (int b = 0; b < side; b++) {
+                if (d < distance[b]) {
+                    distance[b] = d;
+                    entry[b] = (unsigned short) i;
+                }
+                d += inc;
+                inc += 2 * step * step;
+            }
+        }
+    }
+}
+
+// KCIQ: allocate an inverse colormap of 2^bits cells per channel
+static Lut * ciq_lut_create(int bits) {
+    Lut * lut = (Lut *) malloc(sizeof(Lut));
+    if (!lut) return NULL;
+
+    long cells = 1L << 3 * bits;
+    lut->bits = bits;
+    lut->palette = NULL;
+    lut->K = 0;
+    lut->entry = (unsigned short *) malloc(cells * sizeof(unsigned short));
+    lut->distance = (int *) malloc(cells * sizeof(int));
+    if (!lut->entry || !lut->distance) {
+        ciq_lut_free(lut);
+        return NULL;
+    }
+    return lut;
+}
+
+// KCIQ: fill the inverse colormap of a palette
+// The cells map to the entry nearest to their center, so a color may map to
+// an entry that is not exactly the nearest one; 5 or 6 bits keep the error
+// within a fraction of a palette step.
+static void ciq_lut_fill(Pool * pool, Lut * lut, const Centroid * palette, int K) {
+    lut->palette = palette;
+    lut->K = K;
+    // chunks are a multiple of a row of cells
+    ciq_parallel(pool, ciq_lut_task, lut, 1L << 3 * lut->bits);
+}
+
+// KCIQ: palette entry of a color
+static int ciq_lut_lookup(const Lut * lut, int r, int g, int b) {
+    int shift = 8 - lut->bits;
+    return lut->entry[(long) (r >> shift) << 2 * lut->bits | (g >> shift) << lut->bits | b >> shift];
+}
+
+// KCIQ: free the mini-batch state
+static void ciq_minibatch_free(MiniBatch * m) {
+    if (!m) return;
+    if (m->points) free(m->points);
+    if (m->nearest) free(m->nearest);
+    if (m->centers) free(m->centers);
+    if (m->seen) free(m->seen);
+    free(m);
+}
+
+// KCIQ: free the Elkan bounds
+static void ciq_elkan_free(Elkan * e) {
+    if (!e) return;
+    if (e->moved) free(e->moved);
+    if (e->drift) free(e->drift);
+    if (e->between) free(e->between);
+    if (e->half) free(e->half);
+    if (e->previous) free(e->previous);
+    free(e);
+}
+
+// KCIQ: free the Yinyang groups
+static void ciq_yinyang_free(Yinyang * y) {
+    if (!y) return;
+    if (y->drift) free(y->drift);
+    if (y->spread) free(y->spread);
+    if (y->group) free(y->group);
+    if (y->member) free(y->member);
+    if (y->first) free(y->first);
+    if (y->r) free(y->r);
+    if (y->previous) free(y->previous);
+    free(y);
+}
+
+// KCIQ: free the kd-tree
+static void ciq_kdtree_free(KdTree * t) {
+    if (!t) return;
+    if (t->nodes && !t->borrowed) free(t->nodes);
+    if (t->scratch) free(t->scratch);
+    if (t->cluster_size) free(t->cluster_size);
+    if (t->sum_r) free(t->sum_r);
+    if (t->sum_g) free(t->sum_g);
+    if (t->sum_b) free(t->sum_b);
+    if (t->previous) free(t->previous);
+    free(t);
+}
+
+// KCIQ: free memory
+void ciq_shutdown(Context * ctx) {
+    if (!ctx) return;
+    ciq_elkan_free(ctx->elkan);
+    ciq_yinyang_free(ctx->yinyang);
+    ciq_kdtree_free(ctx->kdtree);
+    ciq_minibatch_free(ctx->minibatch);
+    ciq_lut_free(ctx->lut);
+    for (int r = 1; ctx->runs && r < ctx->restarts; r++)
+        ciq_shutdown(ctx->runs[r]);
+    if (ctx->runs)
+        free(ctx->runs);
+    if (!ctx->shared)
+        ciq_pool_destroy(ctx->pool);
+    if (ctx->centroids)
+        free(ctx->centroids);
+    ciq_soa_free(&ctx->soa);
+    ciq_acc_free(&ctx->acc);
+    ciq_arena_free(&ctx->arena);
+    free(ctx);
+}
+
+// KCIQ: wall clock time in seconds
+double ciq_seconds(void) {
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1.0e-9;
+#else
+    return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+// KCIQ: check if work lasting margin seconds would end past a deadline, 0 for none
+static bool ciq_expired(double deadline, double margin) {
+    return deadline > 0 && ciq_seconds() + margin >= deadline;
+}
+
+// KCIQ: expand RGB triples to RGBX pixels
+static void ciq_decode(Pixel * pixels, const unsigned char * rgb, long count) {
+    for (long i = 0; i < count; i++, rgb += 3)
+        pixels[i] = (Pixel) { rgb[0], rgb[1], rgb[2], 0 };
+}
+
+// KCIQ: build the table of unique colors and their number of pixels
+static bool ciq_build_histogram(Context * ctx) {
+    long i, n = ctx->size, unique = 0, count[256];
+    int shift, c;
+    int * order = (int *) ciq_arena_get(&ctx->arena, SLOT_ORDER, n * sizeof(int));
+    int * sorted = (int *) ciq_arena_get(&ctx->arena, SLOT_SORTED, n * sizeof(int));
+    ctx->index = (int *) ciq_arena_get(&ctx->arena, SLOT_INDEX, n * sizeof(int));
+
+    if (!order || !sorted || !ctx->index)
+        return false;
+
+    // LSD radix sort of the pixel indices by packed color, one byte per pass
+    for (i = 0; i < n; i++)
+        order[i] = i;
+    for (shift = 0; shift < 24; shift += 8) {
+        long offset = 0;
+        memset(count, 0, sizeof(count));
+        for (i = 0; i < n; i++)
+            count[PACK(ctx->pixels[i]) >> shift & 255]++;
+        for (c = 0; c < 256; c++) {
+            long size = count[c];
+            count[c] = offset;
+            offset += size;
+        }
+        for (i = 0; i < n; i++) {
+            int k = order[i];
+            sorted[count[PACK(ctx->pixels[k]) >> shift & 255]++] = k;
+        }
+        int * swap = order;
+        order = sorted;
+        sorted = swap;
+    }
+
+    // count the runs of equal colors
+    for (i = 0; i < n; i++) {
+        if (i == 0 || PACK(ctx->pixels[order[i]]) != PACK(ctx->pixels[order[i - 1]]))
+            unique++;
+    }
+
+    ctx->colors = (Pixel *) ciq_arena_get(&ctx->arena, SLOT_COLORS, unique * sizeof(Pixel));
+    ctx->weights = (long *) ciq_arena_get(&ctx->arena, SLOT_WEIGHTS, unique * sizeof(long));
+    if (!ctx->colors || !ctx->weights)
+        return false;
+
+    // collapse the runs into the table
+    for (i = 0, c = -1; i < n; i++) {
+        Pixel * p = &ctx->pixels[order[i]];
+        if (c < 0 || PACK(*p) != PACK(ctx->colors[c])) {
+            c++;
+            ctx->colors[c] = *p;
+            ctx->weights[c] = 0;
+        }
+        ctx->weights[c]++;
+        ctx->index[order[i]] = c;
+    }
+
+    ctx->data = ctx->colors;
+    ctx->count = unique;
+#ifdef __DEBUG__
+    printf("- Number of unique colors: %ld\n", unique);
+#endif
+    return true;
+}
+
+// KCIQ: channel d of a color
+static int ciq_channel(const Pixel * p, int d) {
+    return d == 0 ? p->r : (d == 1 ? p->g : p->b);
+}
+
+// KCIQ: create the kd-tree node holding the data points order[begin, end)
+static int ciq_kdtree_node(Context * ctx, KdTree * t, long begin, long end) {
+    KdNode * node;
+    long i;
+    int d, index;
+
+    if (t->size == t->capacity) {
+        int capacity = t->capacity ? 2 * t->capacity : 1024;
+        KdNode * nodes = (KdNode *) realloc(t->nodes, capacity * sizeof(KdNode));
+        if (!nodes) return -1;
+        t->nodes = nodes;
+        t->capacity = capacity;
+    }
+    index = t->size++;
+    node = &t->nodes[index];
+    node->begin = begin;
+    node->end = end;
+    node->left = node->right = -1;
+    node->count = node->sum[0] = node->sum[1] = node->sum[2] = 0;
+    for (d = 0; d < 3; d++) {
+        node->lo[d] = 255;
+        node->hi[d] = 0;
+    }
+
+    // bounding box and cached sums
+    for (i = begin; i < end; i++) {
+        const Pixel * p = &ctx->data[t->order[i]];
+        long n = ctx->weights ? ctx->weights[t->order[i]] : 1;
+        for (d = 0; d < 3; d++) {
+            int v = ciq_channel(p, d);
+            if (v < node->lo[d]) node->lo[d] = v;
+            if (v > node->hi[d]) node->hi[d] = v;
+            node->sum[d] += n * v;
+        }
+        node->count += n;
+    }
+
+    // split the widest channel in the middle of its range
+    int widest = 0;
+    for (d = 1; d < 3; d++) {
+        if (node->hi[d] - node->lo[d] > node->hi[widest] - node->lo[widest])
+            widest = d;
+    }
+    if (end - begin <= LEAF_SIZE || node->hi[widest] == node->lo[widest])
+        return index;
+
+    int mid = (node->lo[widest] + node->hi[widest] + 1) / 2;
+    long split = begin;
+    for (i = begin; i < end; i++) {
+        if (ciq_channel(&ctx->data[t->order[i]], widest) < mid) {
+            int swap = t->order[i];
+            t->order[i] = t->order[split];
+            t->order[split++] = swap;
+        }
+    }
+
+    int left = ciq_kdtree_node(ctx, t, begin, split);
+    int right = left < 0 ? -1 : ciq_kdtree_node(ctx, t, split, end);
+    if (right < 0) return -1;
+    t->nodes[index].left = left;    // the nodes may have been reallocated
+    t->nodes[index].right = right;
+    return index;
+}
+
+// KCIQ: allocate a kd-tree without nodes and its per-centroid arrays
+static KdTree * ciq_kdtree_create(int K) {
+    KdTree * t = (KdTree *) calloc(1, sizeof(KdTree));
+    if (!t) return NULL;
+    t->scratch = (int *) malloc((long) (MAX_DEPTH + 2) * K * sizeof(int));
+    t->cluster_size = (long *) malloc(K * sizeof(long));
+    t->sum_r = (long *) malloc(K * sizeof(long));
+    t->sum_g = (long *) malloc(K * sizeof(long));
+    t->sum_b = (long *) malloc(K * sizeof(long));
+    t->previous = (Centroid *) malloc(K * sizeof(Centroid));
+    if (!t->scratch || !t->cluster_size || 
+        !t->sum_r || !t->sum_g || !t->sum_b || !t->previous) {
+        ciq_kdtree_free(t);
+        return NULL;
+    }
+    return t;
+}
+
+// KCIQ: build the kd-tree over the data points
+static bool ciq_kdtree_build(Context * ctx) {
+    // the tree of a reloaded context keeps its nodes and per-centroid arrays
+    if (!ctx->kdtree)
+        ctx->kdtree = ciq_kdtree_create(ctx->K);
+    KdTree * t = ctx->kdtree;
+    if (!t)
+        return false;
+    t->size = 0;
+    t->order = (int *) ciq_arena_get(&ctx->arena, SLOT_TREE, ctx->count * sizeof(int));
+    if (!t->order)
+        return false;
+
+    for (long i = 0; i < ctx->count; i++)
+        t->order[i] = i;
+    if (ciq_kdtree_node(ctx, t, 0, ctx->count) < 0)
+        return false;
+#ifdef __DEBUG__
+    printf("- Number of kd-tree nodes: %d\n", t->size);
+#endif
+    return true;
+}
+
+// KCIQ: load an image into the context, reusing the buffers of the last one
+bool ciq_reload(Context * ctx, const unsigned char * rgb, int width, int height) {
+    if (!ctx || !rgb || width <= 0 || height <= 0) {
+#ifdef  __DEBUG__
+        fprintf(stderr, "Invalid image\n");
+#endif
+        return false;
+    }
+
+    ctx->width = width;
+    ctx->height = height;
+    ctx->size = (long) width * height;
+    ctx->colors = NULL;
+    ctx->weights = NULL;
+    ctx->index = NULL;
+    ctx->labeled = false;
+    ctx->lut_ready = false;
+    ctx->evaluations = 0;
+    ctx->stats.load = ciq_seconds();
+
+#ifdef __DEBUG__
+    printf("- Image size: %dx%d\n", width, height);
+    printf("- Number of data points: %ld\n", ctx->size);
+    printf("- Number of clusters: %d\n", ctx->K);
+#endif
+
+    // decode the pixels into the buffer of the previous image if large enough
+    ctx->pixels = (Pixel *) ciq_arena_get(&ctx->arena, SLOT_PIXELS, ctx->size * sizeof(Pixel));
+    if (!ctx->pixels) {
+#ifdef __DEBUG__
+        fprintf(stderr, "Memory allocation failed\n");
+#endif
+        return false;
+    }
+    ciq_decode(ctx->pixels, rgb, ctx->size);
+
+    // cluster the pixels themselves unless the color table is requested
+    ctx->data = ctx->pixels;
+    ctx->count = ctx->size;
+    if (ctx->histogram && !ciq_build_histogram(ctx)) {
+#ifdef __DEBUG__
+        fprintf(stderr, "Unable to build the color histogram\n");
+#endif
+        return false;
+    }
+
+    // every label is written by the first assignment pass
+    ctx->labels = ciq_arena_get(&ctx->arena, SLOT_LABELS, ctx->count * ctx->label_size);
+    if (!ctx->labels) {
+#ifdef __DEBUG__
+        fprintf(stderr, "Memory allocation failed\n");
+#endif
+        return false;
+    }
+
+    // the kd-tree is built once per image and reused by every iteration
+    if (ctx->algorithm == CIQ_KDTREE && !ciq_kdtree_build(ctx)) {
+#ifdef __DEBUG__
+        fprintf(stderr, "Unable to build the kd-tree\n");
+#endif
+        return false;
+    }
+    ctx->stats.load = ciq_seconds() - ctx->stats.load;
+    return true;
+}
+
+// KCIQ: check that the options are in range, 0 keeps the default where there is one
+static bool ciq_check_options(const Options * opts) {
+    const char * error = NULL;
+    if (opts->K < 1 || opts->K > MAX_K)
+        error = "The number of clusters must be between 1 and 65536";
+    else if (opts->lut != 0 && (opts->lut < MIN_LUT || opts->lut > MAX_LUT))
+        error = "The inverse colormap needs 4 to 8 bits per channel";
+    else if ((unsigned) opts->algorithm > CIQ_YINYANG || (unsigned) opts->seeding > CIQ_AFKMC2)
+        error = "Unknown algorithm or initialization";
+    else if (opts->seeding == CIQ_AFKMC2 && opts->chain < 1)
+        error = "The Markov chains need at least one step";
+    else if (opts->batch < 0 || (opts->batch > 0 && opts->batches < 1))
+        error = "Mini-batches need a positive size and count";
+    else if (opts->threads < 0 || opts->iterations < 0 || opts->restarts < 0 ||
+             opts->deadline < 0 || opts->tolerance < 0 || opts->improvement < 0)
+        error = "Negative option";
+#ifdef  __DEBUG__
+    if (error)
+        fprintf(stderr, "%s\n", error);
+#endif
+    return error == NULL;
+}
+
+// KCIQ: initialize the context
+Context * ciq_init(const unsigned char * rgb, int width, int height, const Options * opts) {
+    double start = ciq_seconds();
+    int K = opts->K;
+    if (!ciq_check_options(opts))
+        return NULL;
+
+    Context * ctx = (Context *) calloc(1, sizeof(Context));
+    if (!ctx) {
+#ifdef  __DEBUG__
+        fprintf(stderr, "Memory allocation failed\n");
+#endif
+        return NULL;
+    }
+
+    // settings shared by every image loaded into the context
+    ctx->K = K;
+    ctx->label_size = K <= 256 ? 1 : 2;
+    ctx->histogram = opts->histogram;
+    ctx->algorithm = opts->batch > 0 ? CIQ_LLOYD : opts->algorithm;
+    ctx->requested = ctx->algorithm;
+    ctx->seeding = opts->seeding;
+    ctx->chain = opts->chain;
+    ctx->batch = opts->batch;
+    ctx->batches = opts->batches;
+    ctx->lut_bits = opts->lut;
+    ctx->budget = opts->deadline;
+    ctx->iterations = opts->iterations > 0 ? opts->iterations : MAX_ITERS;
+    ctx->tolerance = opts->tolerance;
+    ctx->improvement = opts->improvement;
+    ctx->seed = opts->seed;
+    ctx->restarts = opts->restarts > 0 ? opts->restarts : 1;
+    ctx->verbose = opts->verbose;
+
+    // allocate memory for the centroids
+    ctx->centroids = (Centroid *) calloc(K, sizeof(Centroid));
+    if (!ctx->centroids || !ciq_soa_init(&ctx->soa, ctx->centroids, K)) {
+#ifdef __DEBUG__
+        fprintf(stderr, "Memory allocation failed\n");
+#endif
+        ciq_shutdown(ctx);
+        return NULL;
+    }
+
+    // start the worker threads, unless the caller shares a pool
+    ctx->shared = opts->pool != NULL;
+    ctx->pool = ctx->shared ? opts->pool : ciq_pool_create(opts->threads, false);
+    if (!ctx->pool) {
+#ifdef __DEBUG__
+        fprintf(stderr, "Unable to create the thread pool\n");
+#endif
+        ciq_shutdown(ctx);
+        return NULL;
+    }
+
+    if (!ciq_acc_init(&ctx->acc, ctx->pool->threads, K)) {
+#ifdef __DEBUG__
+        fprintf(stderr, "Memory allocation failed\n");
+#endif
+        ciq_shutdown(ctx);
+        return NULL;
+    }
+
+#ifdef CIQ_THREADS
+    pthread_once(&ciq_kernel_once, ciq_select_kernel);
+#else
+    ciq_select_kernel();
+#endif
+    if (!ciq_reload(ctx, rgb, width, height)) {
+        ciq_shutdown(ctx);
+        return NULL;
+    }
+    ctx->stats.load = ciq_seconds() - start;
+    return ctx;     // return the context
+}
+
+// KCIQ: expand a seed into the generator state with splitmix64
+static void ciq_random_seed(Random * r, unsigned long long seed) {
+    for (int i = 0; i < 4; i++) {
+        unsigned long long z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        r->s[i] = z ^ (z >> 31);
+    }
+}
+
+// KCIQ: next 64 random bits
+static unsigned long long ciq_random_next(Random * r) {
+    unsigned long long * s = r->s;
+    unsigned long long x = s[1] * 5;
+    unsigned long long result = (x << 7 | x >> 57) * 9;
+    unsigned long long t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = s[3] << 45 | s[3] >> 19;
+    return result;
+}
+
+// KCIQ: uniform number in [0, 1)
+static double ciq_random(Random * r) {
+    return (double) (ciq_random_next(r) >> 11) / 9007199254740992.0;
+}
+
+// KCIQ: uniform integer in [0, n)
+static long ciq_random_below(Random * r, long n) {
+    return (long) (ciq_random(r) * n);
+}
+
+// KCIQ: account for the last seed in the points [begin, end)
+// The weighted distances are summed per CHUNK_SIZE points, in a fixed order,
+// so the totals do not depend on how the chunks are scheduled.
+static void ciq_seeder_task(void * arg, long begin, long end) {
+    Seeder * s = (Seeder *) arg;
+
+    for (long chunk = begin; chunk < end; chunk += CHUNK_SIZE) {
+        long last = chunk + CHUNK_SIZE < end ? chunk + CHUNK_SIZE : end;
+        long long total = 0;
+        for (long j = chunk; j < last; j++) {
+            int d = (int) ciq_pixel_distance(s->data[j], s->seed);
+            if (d < s->mindist[j])
+                s->mindist[j] = d;
+            total += s->weights ? (long long) s->weights[j] * s->mindist[j] : s->mindist[j];
+        }
+        s->totals[chunk / CHUNK_SIZE] = (double) total;
+    }
+}
+
+// KCIQ: pick a point with probability proportional to its weighted distance
+static long ciq_seeder_pick(Seeder * s) {
+    long chunks = (s->count + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    long lo = 0, hi = chunks - 1, j;
+
+    // prefix sums of the chunk totals
+    for (j = 1; j < chunks; j++)
+        s->totals[j] += s->totals[j - 1];
+    double choice = ciq_random(s->random) * s->totals[chunks - 1];
+
+    // binary search of the chunk, then of the point inside the chunk
+    while (lo < hi) {
+        long mid = (lo + hi) / 2;
+        if (s->totals[mid] > choice)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    double cumulative = lo > 0 ? s->totals[lo - 1] : 0;
+    long last = (lo + 1) * CHUNK_SIZE < s->count ? (lo + 1) * CHUNK_SIZE : s->count;
+    for (j = lo * CHUNK_SIZE; j < last - 1; j++) {
+        cumulative += s->weights ? (double) s->weights[j] * s->mindist[j] : s->mindist[j];
+        if (cumulative > choice)
+            break;
+    }
+    return j;
+}
+
+// KCIQ: pick the seeds centroids[first..K) uniformly when out of time
+static void ciq_seed_uniform(Random * random, const Pixel * data, long count, Centroid * centroids,
+                             int first, int K) {
+    for (int i = first; i < K; i++) {
+        const Pixel * p = &data[ciq_random_below(random, count)];
+        centroids[i] = (Centroid){ p->r, p->g, p->b };
+    }
+}
+
+// KCIQ: choose centroids[1..K) by k-means++ once centroids[0] is set
+// Past the deadline, the remaining seeds are drawn uniformly.
+static void ciq_kmeanspp(Pool * pool, Seeder * s, Centroid * centroids, int K, double deadline) {
+    for (long j = 0; j < s->count; j++)
+        s->mindist[j] = 0x7fffffff;
+
+    for (int i = 1; i < K; i++) {
+        if (ciq_expired(deadline, 0)) {
+            ciq_seed_uniform(s->random, s->data, s->count, centroids, i, K);
+            break;
+        }
+        // keep the distance to the nearest seed up to date
+        s->seed = centroids[i - 1];
+        ciq_parallel(pool, ciq_seeder_task, s, s->count);
+
+        long j = ciq_seeder_pick(s);
+        centroids[i] = (Centroid){ s->data[j].r, s->data[j].g, s->data[j].b };
+#ifdef __DEBUG__
+        printf("- Centroid %3d: (%d, %d, %d)\n", i,
+                centroids[i].r, centroids[i].g, centroids[i].b);
+#endif                                                
+    }
+}
+
+// KCIQ: uniform number in [0, 1) derived from a key (splitmix64 finalizer)
+// Each point draws from its own key, so the k-means|| samples do not depend
+// on the number of threads or on the order the chunks are run.
+static double ciq_hash(unsigned long long key) {
+    key += 0x9e3779b97f4a7c15ULL;
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return (double) (key >> 11) / 9007199254740992.0;
+}
+
+// KCIQ: account for the candidates of the last round in the points [begin, end)
+static void ciq_sampler_update_task(void * arg, long begin, long end) {
+    Sampler * m = (Sampler *) arg;
+    Seeder * s = m->seeder;
+    Nearest nearest = ciq_nearest;
+    long distance;
+
+    for (long chunk = begin; chunk < end; chunk += CHUNK_SIZE) {
+        long last = chunk + CHUNK_SIZE < end ? chunk + CHUNK_SIZE : end;
+        long long total = 0;
+        if (m->first > 0 && ciq_expired(m->deadline, 0))
+            continue;       // out of time, the points keep their nearest candidate so far
+        for (long j = chunk; j < last; j++) {
+            int i = nearest(&m->soa, s->data[j].r, s->data[j].g, s->data[j].b, &distance);
+            if (distance < s->mindist[j]) {
+                s->mindist[j] = (int) distance;
+                m->nearest[j] = (int) (m->first + i);
+            }
+            total += s->weights ? (long long) s->weights[j] * s->mindist[j] : s->mindist[j];
+        }
+        s->totals[chunk / CHUNK_SIZE] = (double) total;
+    }
+}
+
+// KCIQ: select each point of [begin, end) independently, with probability
+// proportional to its weighted distance to the nearest candidate
+static void ciq_sampler_pick_task(void * arg, long begin, long end) {
+    Sampler * m = (Sampler *) arg;
+    Seeder * s = m->seeder;
+    long picked[CHUNK_SIZE];
+
+    for (long chunk = begin; chunk < end; chunk += CHUNK_SIZE) {
+        long last = chunk + CHUNK_SIZE < end ? chunk + CHUNK_SIZE : end;
+        long n = 0;
+        for (long j = chunk; j < last; j++) {
+            double p = m->factor * s->mindist[j] * (s->weights ? s->weights[j] : 1);
+            if (p > 0 && ciq_hash(m->key ^ (unsigned long long) j * 0xd1b54a32d192ed03ULL) < p)
+                picked[n++] = j;
+        }
+        if (n == 0) continue;
+
+        ciq_lock(m->pool);
+        if (m->count + n > m->capacity) {
+            long capacity = 2 * (m->count + n);
+            long * grown = (long *) realloc(m->picked, capacity * sizeof(long));
+            if (grown) {
+                m->picked = grown;
+                m->capacity = capacity;
+            }
+            else
+                n = m->capacity - m->count;     // out of memory, keep what fits
+        }
+        memcpy(m->picked + m->count, picked, n * sizeof(long));
+        m->count += n;
+        ciq_unlock(m->pool);
+    }
+}
+
+// KCIQ: compare two point indices
+static int ciq_compare_index(const void * a, const void * b) {
+    long x = *(const long *) a, y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+// KCIQ: reduce weighted candidates to K centroids, k-means++ then a few Lloyd iterations
+// The scratch buffers are kept in the arena for the next call. Past the
+// deadline, the seeds are drawn uniformly and the iterations stop.
+static bool ciq_recluster(Arena * arena, Random * random, const Pixel * points, const long * weights,
+                          long count, Centroid * centroids, int K, double deadline) {
+    Seeder s = { points, weights, count, NULL, NULL, { 0, 0, 0 }, random };
+    Soa soa;
+    long * sums = (long *) ciq_arena_get(arena, SLOT_RECLUSTER_SUMS, 4 * K * sizeof(long));
+    long j, distance, total = 0;
+    s.mindist = (int *) ciq_arena_get(arena, SLOT_RECLUSTER_DISTANCES, count * sizeof(int));
+    s.totals = (double *) ciq_arena_get(arena, SLOT_RECLUSTER_TOTALS,
+                                        (count / CHUNK_SIZE + 1) * sizeof(double));
+    if (!sums || !s.mindist || !s.totals ||
+        !ciq_soa_borrow(&soa, arena, SLOT_RECLUSTER_LAYOUT, centroids, K))
+        return false;
+
+    // first centroid with probability proportional to the weights
+    for (j = 0; j < count; j++)
+        total += weights[j];
+    double choice = ciq_random(random) * total;
+    for (j = 0; j < count - 1 && (choice -= weights[j]) >= 0; j++)
+        ;
+    centroids[0] = (Centroid){ points[j].r, points[j].g, points[j].b };
+    ciq_kmeanspp(NULL, &s, centroids, K, deadline);
+
+    for (int iter = 0; iter < RECLUSTER && !ciq_expired(deadline, 0); iter++) {
+        bool moved = false;
+        ciq_soa_sync(&soa);
+        memset(sums, 0, 4 * K * sizeof(long));
+        for (j = 0; j < count; j++) {
+            long * sum = sums + 4 * ciq_nearest(&soa, points[j].r, points[j].g, points[j].b, &distance);
+            sum[0] += weights[j] * points[j].r;
+            sum[1] += weights[j] * points[j].g;
+            sum[2] += weights[j] * points[j].b;
+            sum[3] += weights[j];
+        }
+        for (int i = 0; i < K; i++) {
+            long * sum = sums + 4 * i;
+            if (sum[3] == 0) continue;      // keep the empty clusters in place
+            Centroid c = { (int) (sum[0] / sum[3]), (int) (sum[1] / sum[3]), (int) (sum[2] / sum[3]) };
+            if (c.r != centroids[i].r || c.g != centroids[i].g || c.b != centroids[i].b) {
+                centroids[i] = c;
+                moved = true;
+            }
+        }
+        if (!moved) break;
+    }
+    return true;
+}
+
+// KCIQ: choose centroids[1..K) by k-means|| once centroids[0] is set
+// A few rounds oversample about OVERSAMPLING * K candidates each, with one
+// pass over the data per round instead of one per centroid; the candidates,
+// weighted by the points closest to them, are then reclustered into K seeds.
+// Past the deadline, no more rounds are sampled, the pass accounting for the
+// last candidates leaves the remaining points with their previous nearest
+// candidate, and the reclustering stops.
+static bool ciq_kmeans_parallel(Pool * pool, Arena * arena, Seeder * s, Centroid * centroids, int K,
+                                double deadline) {
+    Sampler m = { s, { NULL, 0, 0, NULL, NULL, NULL }, 0, NULL, pool, 0, 0, NULL, 0, 0, deadline };
+    Centroid * candidates = (Centroid *) malloc(K * sizeof(Centroid));
+    Pixel * points = NULL;
+    long * weights = NULL;
+    long count = 1, capacity = K, chunks = (s->count + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    unsigned long long salt = ciq_random_next(s->random);
+    bool ok = false, late = false;
+
+    m.nearest = (int *) ciq_arena_get(arena, SLOT_NEAREST, s->count * sizeof(int));
+    if (!candidates || !m.nearest) {
+        if (candidates) free(candidates);
+        return false;
+    }
+    candidates[0] = centroids[0];
+
+    for (long j = 0; j < s->count; j++)
+        s->mindist[j] = 0x7fffffff;
+
+    for (int round = 0; round <= ROUNDS; round++) {
+        // account for the candidates added by the previous round
+        m.first = round == 0 ? 0 : count - m.count;
+        if (!ciq_soa_init(&m.soa, candidates + m.first, (int) (count - m.first)))
+            goto done;
+        ciq_parallel(pool, ciq_sampler_update_task, &m, s->count);
+        ciq_soa_free(&m.soa);
+        if (round == ROUNDS) break;
+        if (ciq_expired(deadline, 0)) {
+            late = true;
+            break;
+        }
+
+        double cost = 0;
+        for (long c = 0; c < chunks; c++)
+            cost += s->totals[c];
+        if (cost == 0) break;       // every point is a candidate already
+
+        // sample the next candidates, in index order whatever the schedule
+        m.factor = OVERSAMPLING * K / cost;
+        m.key = salt + (unsigned long long) round * 0x9e3779b97f4a7c15ULL;
+        m.count = 0;
+        ciq_parallel(pool, ciq_sampler_pick_task, &m, s->count);
+        if (m.count == 0) break;
+        qsort(m.picked, m.count, sizeof(long), ciq_compare_index);
+
+        if (count + m.count > MAX_K) m.count = MAX_K - count;
+        if (count + m.count > capacity) {
+            capacity = 2 * (count + m.count);
+            Centroid * grown = (Centroid *) realloc(candidates, capacity * sizeof(Centroid));
+            if (!grown) goto done;
+            candidates = grown;
+        }
+        for (long i = 0; i < m.count; i++) {
+            const Pixel * p = &s->data[m.picked[i]];
+            candidates[count++] = (Centroid){ p->r, p->g, p->b };
+        }
+        if (m.count == 0) break;
+    }
+#ifdef __DEBUG__
+    printf("- k-means|| candidates: %ld\n", count);
+#endif
+
+    // out of time before K candidates, use them all and draw the others
+    if (late && count < K) {
+        memcpy(centroids, candidates, count * sizeof(Centroid));
+        ciq_seed_uniform(s->random, s->data, s->count, centroids, (int) count, K);
+        ok = true;
+        goto done;
+    }
+
+    // weight each candidate by the points closest to it
+    points = (Pixel *) malloc(count * sizeof(Pixel));
+    weights = (long *) calloc(count, sizeof(long));
+    if (!points || !weights)
+        goto done;
+    for (long j = 0; j < s->count; j++)
+        weights[m.nearest[j]] += s->weights ? s->weights[j] : 1;
+    for (long i = 0; i < count; i++)
+        points[i] = (Pixel){ (unsigned char) candidates[i].r, (unsigned char) candidates[i].g,
+                             (unsigned char) candidates[i].b, 0 };
+
+    ok = ciq_recluster(arena, s->random, points, weights, count, centroids, K, deadline);
+
+done:
+    if (m.picked) free(m.picked);
+    if (points) free(points);
+    if (weights) free(weights);
+    free(candidates);
+    return ok;
+}
+
+
+// KCIQ: build the running sums of the proposal over the points [begin, end)
+static void ciq_proposal_task(void * arg, long begin, long end) {
+    Proposal * q = (Proposal *) arg;
+
+    for (long chunk = begin; chunk < end; chunk += CHUNK_SIZE) {
+        long last = chunk + CHUNK_SIZE < end ? chunk + CHUNK_SIZE : end;
+        long long distance = 0, weight = 0;
+        for (long j = chunk; j < last; j++) {
+            long w = q->weights ? q->weights[j] : 1;
+            distance += (long long) w * ciq_pixel_distance(q->data[j], q->first);
+            q->distance[j] = (double) distance;
+            if (q->weight) {
+                weight += w;
+                q->weight[j] = (double) weight;
+            }
+        }
+        q->dtotals[chunk / CHUNK_SIZE] = (double) distance;
+        q->wtotals[chunk / CHUNK_SIZE] = (double) (q->weight ? weight : last - chunk);
+    }
+}
+
+// KCIQ: draw a point from one of the two terms of the proposal
+// The chunk is found by binary search over the prefix sums of the chunk totals,
+// then the point by binary search over the running sums inside the chunk.
+static long ciq_proposal_draw(const Proposal * q, Random * random, const double * totals,
+                              const double * running) {
+    long chunks = (q->count + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    long lo = 0, hi = chunks - 1;
+    double choice = ciq_random(random) * totals[chunks - 1];
+
+    while (lo < hi) {
+        long mid = (lo + hi) / 2;
+        if (totals[mid] > choice)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    choice -= lo > 0 ? totals[lo - 1] : 0;
+    long first = lo * CHUNK_SIZE;
+    if (!running) {
+        // unit weights, uniform inside the chunk
+        long j = first + (long) choice;
+        return j < q->count ? j : q->count - 1;
+    }
+
+    long last = first + CHUNK_SIZE < q->count ? first + CHUNK_SIZE : q->count;
+    lo = first, hi = last - 1;
+    while (lo < hi) {
+        long mid = (lo + hi) / 2;
+        if (running[mid] > choice)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    return lo;
+}
+
+// KCIQ: probability of the point j under the proposal, up to a constant factor
+static double ciq_proposal_density(const Proposal * q, long j) {
+    long w = q->weights ? q->weights[j] : 1;
+    if (q->distance_sum == 0)
+        return w / q->weight_sum;
+    return w * (ciq_pixel_distance(q->data[j], q->first) / q->distance_sum + 1 / q->weight_sum);
+}
+
+// KCIQ: choose centroids[1..K) by AFK-MC² once centroids[0] is set
+// One pass over the data builds the proposal q(x) = d(x, c0)² / 2D + 1 / 2W,
+// then each seed is the last state of a Markov chain of `chain` points drawn
+// from q, accepting y over x with probability w(y) d(y, C)² q(x) / w(x) d(x, C)² q(y),
+// so a unique color is picked as often as its pixels would be.
+// The chains only measure distances to the seeds, whatever the image size.
+static bool ciq_afkmc2(Pool * pool, Arena * arena, Random * random, const Pixel * data,
+                       const long * weights, long count, Centroid * centroids, int K, int chain,
+                       double deadline) {
+    Proposal q = { data, weights, count, centroids[0], NULL, NULL, NULL, NULL, 0, 0 };
+    long chunks = (count + CHUNK_SIZE - 1) / CHUNK_SIZE, j;
+    Soa soa;
+
+    q.distance = (double *) ciq_arena_get(arena, SLOT_DISTANCES, count * sizeof(double));
+    q.weight = weights ? (double *) ciq_arena_get(arena, SLOT_RUNNING, count * sizeof(double)) : NULL;
+    q.dtotals = (double *) ciq_arena_get(arena, SLOT_TOTALS, 2 * chunks * sizeof(double));
+    if (!q.distance || (weights && !q.weight) || !q.dtotals || !ciq_soa_init(&soa, centroids, K))
+        return false;
+    q.wtotals = q.dtotals + chunks;
+
+    ciq_parallel(pool, ciq_proposal_task, &q, count);
+    for (j = 1; j < chunks; j++) {
+        q.dtotals[j] += q.dtotals[j - 1];
+        q.wtotals[j] += q.wtotals[j - 1];
+    }
+    q.distance_sum = q.dtotals[chunks - 1];
+    q.weight_sum = q.wtotals[chunks - 1];
+
+    // the kernels only see the seeds chosen so far, the others are padding
+    for (j = 1; j < soa.padded; j++)
+        soa.r[j] = soa.g[j] = soa.b[j] = FAR;
+    soa.count = 1;
+    soa.padded = LANES;
+
+    for (int i = 1; i < K; i++) {
+        long x = 0;
+        double dx = -1, qx = 0;
+        if (ciq_expired(deadline, 0)) {
+            ciq_seed_uniform(random, data, count, centroids, i, K);
+            break;
+        }
+        for (int step = 0; step < chain; step++) {
+            bool uniform = q.distance_sum == 0 || ciq_random_next(random) >> 63;
+            long y = uniform ? ciq_proposal_draw(&q, random, q.wtotals, q.weight)
+                             : ciq_proposal_draw(&q, random, q.dtotals, q.distance);
+            long distance;
+            ciq_nearest(&soa, data[y].r, data[y].g, data[y].b, &distance);
+            double dy = (double) (weights ? weights[y] : 1) * distance;
+            double qy = ciq_proposal_density(&q, y);
+            if (dx <= 0 || dy * qx > ciq_random(random) * dx * qy) {
+                x = y;
+                dx = dy;
+                qx = qy;
+            }
+        }
+
+        centroids[i] = (Centroid){ data[x].r, data[x].g, data[x].b };
+        soa.r[i] = (float) centroids[i].r;
+        soa.g[i] = (float) centroids[i].g;
+        soa.b[i] = (float) centroids[i].b;
+        soa.count = i + 1;
+        soa.padded = (soa.count + LANES - 1) / LANES * LANES;
+#ifdef __DEBUG__
+        printf("- Centroid %3d: (%d, %d, %d)\n", i,
+                centroids[i].r, centroids[i].g, centroids[i].b);
+#endif
+    }
+
+    ciq_soa_free(&soa);
+    return true;
+}
+
+// KCIQ: K-means++, k-means|| or AFK-MC² initialization
+static bool ciq_init_centroids(Context * ctx) {
+
+    if (!ctx) return false;
+
+    long chosen_index;
+    Seeder s = { ctx->data, ctx->weights, ctx->count, NULL, NULL, { 0, 0, 0 }, &ctx->random };
+    if (ctx->seeding != CIQ_AFKMC2) {
+        s.mindist = (int *) ciq_arena_get(&ctx->arena, SLOT_DISTANCES, ctx->count * sizeof(int));
+        s.totals = (double *) ciq_arena_get(&ctx->arena, SLOT_TOTALS,
+                                            (ctx->count / CHUNK_SIZE + 1) * sizeof(double));
+        if (!s.mindist || !s.totals)
+            return false;
+    }
+
+#ifdef __DEBUG__
+    double start = ciq_seconds();
+#endif
+
+    // Choose the first centroid randomly, among the pixels of the image
+    chosen_index = ciq_random_below(&ctx->random, ctx->size);
+    ctx->centroids[0] = (Centroid){ ctx->pixels[chosen_index].r, 
+                                    ctx->pixels[chosen_index].g, 
+                                    ctx->pixels[chosen_index].b};
+#ifdef __DEBUG__
+    printf("- Initial centroid: (%d, %d, %d)\n", 
+            ctx->centroids[0].r, ctx->centroids[0].g, ctx->centroids[0].b);
+#endif
+
+    // Choose the remaining centroids, within a share of the time budget that
+    // ends no later than the deadline of the whole palette
+    double deadline = ctx->deadline;
+    if (deadline > 0 && ciq_seconds() + SEEDING_SHARE * ctx->budget / 1000.0 < deadline)
+        deadline = ciq_seconds() + SEEDING_SHARE * ctx->budget / 1000.0;
+    bool ok = true;
+    if (ctx->seeding == CIQ_AFKMC2)
+        ok = ciq_afkmc2(ctx->pool, &ctx->arena, &ctx->random, ctx->data, ctx->weights, ctx->count,
+                        ctx->centroids, ctx->K, ctx->chain, deadline);
+    else if (ctx->seeding == CIQ_KMEANSPAR)
+        ok = ciq_kmeans_parallel(ctx->pool, &ctx->arena, &s, ctx->centroids, ctx->K, deadline);
+    else
+        ciq_kmeanspp(ctx->pool, &s, ctx->centroids, ctx->K, deadline);
+#ifdef __DEBUG__
+    printf("- Seeding done in %.2f ms\n", 1000 * (ciq_seconds() - start));
+#endif
+    return ok;
+}
+
+// KCIQ: assign the points in [begin, end) to the nearest centroid
+static void ciq_clustering_task(void * arg, long begin, long end) {
+    Context * ctx = (Context *) arg;
+    Nearest nearest = ciq_nearest;
+    const Pixel * p = ctx->data;
+    long distance, changed = ctx->assigned ? 0 : end - begin;
+    long * sums = ciq_acc_acquire(ctx->pool, &ctx->acc);
+
+    for (long i = begin; i < end; i++) {
+        int j = nearest(&ctx->soa, p[i].r, p[i].g, p[i].b, &distance);
+        if (ctx->assigned && ciq_label(ctx, i) != j)
+            changed++;
+        ciq_set_label(ctx, i, j);
+        ciq_accumulate(sums + 4 * j, p[i], ctx->weights ? ctx->weights[i] : 1);
+    }
+    ciq_acc_release(ctx->pool, &ctx->acc, sums);
+    ciq_count(ctx->pool, &ctx->changed, changed);
+}
+
+// KCIQ: Elkan assignment of the points in [begin, end)
+// A centroid j is skipped when the upper bound u of the distance to the
+// assigned centroid a proves d(x, j) > d(x, a), either through the lower
+// bound of d(x, j) or through d(a, j) / 2. Only strictly farther centroids
+// are skipped, so ties resolve to the lowest index exactly like Lloyd.
+static void ciq_elkan_task(void * arg, long begin, long end) {
+    Context * ctx = (Context *) arg;
+    Elkan * e = ctx->elkan;
+    const float * moved = e->moved;
+    int j, K = ctx->K;
+    long evaluations = 0, changed = 0;
+    long * sums = ciq_acc_acquire(ctx->pool, &ctx->acc);
+
+    for (long i = begin; i < end; i++) {
+        const Pixel * p = &ctx->data[i];
+        long n = ctx->weights ? ctx->weights[i] : 1;
+        float * l = e->lower + i * K;
+        long da, dj;
+        int a;
+
+        // first pass, compute every distance exactly
+        if (!e->ready) {
+            for (j = 0, a = 0, da = 0; j < K; j++) {
+                dj = ciq_pixel_distance(*p, ctx->centroids[j]);
+                l[j] = sqrt(dj) - SLACK;
+                if (j == 0 || dj < da) {
+                    da = dj;
+                    a = j;
+                }
+            }
+            ciq_set_label(ctx, i, a);
+            ciq_accumulate(sums + 4 * a, *p, n);
+            e->upper[i] = sqrt(da) + SLACK;
+            evaluations += K;
+            changed++;
+            continue;
+        }
+
+        int previous = a = ciq_label(ctx, i);
+        float u = e->upper[i] + e->drift[a];
+        if (u < e->half[a]) {
+            ciq_accumulate(sums + 4 * a, *p, n);
+            e->upper[i] = u;
+            continue;
+        }
+
+        bool tight = false;
+        const float * between = e->between + a * K;
+        for (j = 0, da = 0; j < K; j++) {
+            if (j == a || u + moved[j] < l[j] || u < between[j])
+                continue;
+            // tighten the upper bound once before computing other distances
+            if (!tight) {
+                da = ciq_pixel_distance(*p, ctx->centroids[a]);
+                u = sqrt(da) + SLACK;
+                l[a] = sqrt(da) + moved[a] - SLACK;
+                tight = true;
+                evaluations++;
+                if (u + moved[j] < l[j] || u < between[j])
+                    continue;
+            }
+            dj = ciq_pixel_distance(*p, ctx->centroids[j]);
+            l[j] = sqrt(dj) + moved[j] - SLACK;
+            evaluations++;
+            if (dj < da || (dj == da && j < a)) {
+                da = dj;
+                a = j;
+                u = sqrt(da) + SLACK;
+                between = e->between + a * K;
+            }
+        }
+        if (a != previous) {
+            ciq_set_label(ctx, i, a);
+            changed++;
+        }
+        ciq_accumulate(sums + 4 * a, *p, n);
+        e->upper[i] = u;
+    }
+    ciq_acc_release(ctx->pool, &ctx->acc, sums);
+    ciq_count(ctx->pool, &ctx->evaluations, evaluations);
+    ciq_count(ctx->pool, &ctx->changed, changed);
+}
+
+// KCIQ: fold the distances moved by the centroids into the lower bounds
+static void ciq_elkan_rebase_task(void * arg, long begin, long end) {
+    Context * ctx = (Context *) arg;
+    Elkan * e = ctx->elkan;
+    int K = ctx->K;
+
+    for (long i = begin; i < end; i++) {
+        float * l = e->lower + i * K;
+        for (int j = 0; j < K; j++)
+            l[j] -= e->moved[j];
+    }
+}
+
+// KCIQ: assign points to the nearest centroid with Elkan's algorithm
+static bool ciq_elkan(Context * ctx) {
+    Elkan * e = ctx->elkan;
+    int i, j, K = ctx->K;
 
-// KCIQ: Define boolean type
-#ifndef bool
-    #define bool int
-    #define true 1
-    #define false 0
+    if (!e) {
+        e = (Elkan *) calloc(1, sizeof(Elkan));
+        if (!e) return false;
+        e->moved = (float *) calloc(K, sizeof(float));
+        e->drift = (float *) malloc(K * sizeof(float));
+        e->between = (float *) malloc((long) K * K * sizeof(float));
+        e->half = (float *) malloc(K * sizeof(float));
+        e->previous = (Centroid *) malloc(K * sizeof(Centroid));
+        if (!e->moved || !e->drift || 
+            !e->between || !e->half || !e->previous) {
+#ifdef __DEBUG__
+            fprintf(stderr, "Not enough memory for the Elkan bounds\n");
 #endif
+            ciq_elkan_free(e);
+            return false;
+        }
+        ctx->elkan = e;
+    }
 
-// KCIQ: Define structure for data points and centroids
-typedef struct {
-    int r, g, b;
-    int cluster;
-} Point;
+    // the bounds of the data points are kept in the arena
+    if (!e->ready) {
+        e->upper = (float *) ciq_arena_get(&ctx->arena, SLOT_UPPER, ctx->count * sizeof(float));
+        e->lower = (float *) ciq_arena_get(&ctx->arena, SLOT_LOWER, ctx->count * K * sizeof(float));
+        if (!e->upper || !e->lower) {
+#ifdef __DEBUG__
+            fprintf(stderr, "Not enough memory for the Elkan bounds\n");
+#endif
+            return false;
+        }
+    }
 
-typedef Point Centroid;
+    // distances moved by the centroids, each step rounded up by the slack
+    bool rebase = false;
+    for (i = 0; i < K; i++) {
+        e->drift[i] = e->ready ? sqrt(ciq_distance(e->previous[i], ctx->centroids[i])) + SLACK : 0;
+        e->moved[i] += e->drift[i];
+        if (e->moved[i] > REBASE) rebase = true;
+    }
+    if (rebase) {
+        ciq_parallel(ctx->pool, ciq_elkan_rebase_task, ctx, ctx->count);
+        memset(e->moved, 0, K * sizeof(float));
+    }
 
-typedef struct context {
-    int width, height;
-    long size;
-    int K;
-    Point * points;
-    Centroid * centroids;
-} Context;
+    // half distances between the centroids, rounded down by the slack
+    for (i = 0; i < K; i++)
+        e->half[i] = 1.0e30f;
+    for (i = 0; i < K; i++) {
+        e->between[i * K + i] = 0;
+        for (j = i + 1; j < K; j++) {
+            float d = 0.5 * sqrt(ciq_distance(ctx->centroids[i], ctx->centroids[j])) - SLACK;
+            e->between[i * K + j] = e->between[j * K + i] = d;
+            if (d < e->half[i]) e->half[i] = d;
+            if (d < e->half[j]) e->half[j] = d;
+        }
+    }
 
-// KCIQ: calculate Euclidean distance
-long ciq_distance(Point p1, Centroid p2) {
-    long dr = p1.r - p2.r;
-    long dg = p1.g - p2.g;
-    long db = p1.b - p2.b;
-    return (dr*dr + dg*dg + db*db);
+    ctx->evaluations = 0;
+    ciq_parallel(ctx->pool, ciq_elkan_task, ctx, ctx->count);
+    memcpy(e->previous, ctx->centroids, K * sizeof(Centroid));
+    e->ready = true;
+    return true;
 }
 
-// KCIQ: initialize the context
-Context * ciq_init(const char * filename, int K) {
-    Context * ctx = (Context *) malloc(sizeof(Context));
-    if (!ctx) {
-#ifdef  __DEBUG__
-        fprintf(stderr, "Memory allocation failed\n");
-#endif
-        return false;
+// KCIQ: Yinyang assignment of the points in [begin, end)
+// The global filter keeps the assignment of a point when its upper bound is
+// below every group bound. Otherwise only the groups whose bound is not
+// strictly above the tightened upper bound are scanned, and the centroid that
+// loses the point gives its distance to the bound of its group. Ties resolve
+// to the lowest index exactly like Lloyd.
+static void ciq_yinyang_task(void * arg, long begin, long end) {
+    Context * ctx = (Context *) arg;
+    Yinyang * y = ctx->yinyang;
+    Groups groups = ciq_groups;
+    int g, k, j, K = ctx->K, G = y->groups;
+    long evaluations = 0, changed = 0;
+    long * sums = ciq_acc_acquire(ctx->pool, &ctx->acc);
+
+    for (long i = begin; i < end; i++) {
+        const Pixel * p = &ctx->data[i];
+        long n = ctx->weights ? ctx->weights[i] : 1;
+        float * l = y->lower + i * G;
+        long da = 0, dj;
+        int a = 0;
+
+        // first pass, the distance to every group with the group kernel, then
+        // the nearest centroid and the runner-up of its group among the members
+        if (!y->ready) {
+            float closest = 3.0e38f;
+            int home = 0;
+            groups(y, p->r, p->g, p->b, l);
+            for (g = 0; g < G; g++) {
+                if (l[g] < closest) closest = l[g];
+            }
+            da = (long) closest;
+            for (g = 0, a = K; g < G; g++) {
+                for (k = y->first[g]; l[g] == closest && k < y->first[g + 1]; k++) {
+                    j = y->member[k];
+                    if (j < a && ciq_pixel_distance(*p, ctx->centroids[j]) == da) {
+                        a = j;
+                        home = g;
+                    }
+                }
+            }
+            l[home] = 1.0e30f;
+            for (k = y->first[home]; k < y->first[home + 1]; k++) {
+                j = y->member[k];
+                dj = ciq_pixel_distance(*p, ctx->centroids[j]);
+                if (j != a && dj < l[home])
+                    l[home] = dj;
+            }
+            for (g = 0; g < G; g++)
+                l[g] = sqrt(l[g]) - SLACK;
+            ciq_set_label(ctx, i, a);
+            ciq_accumulate(sums + 4 * a, *p, n);
+            y->upper[i] = sqrt(da) + SLACK;
+            evaluations += K;
+            changed++;
+            continue;
+        }
+
+        // move the bounds with the centroids, the nearest group bound is the global one
+        int previous = a = ciq_label(ctx, i);
+        float u = y->upper[i] + y->drift[a], bound = 1.0e30f;
+        for (g = 0; g < G; g++) {
+            l[g] -= y->spread[g];
+            if (l[g] < bound) bound = l[g];
+        }
+        if (u < bound) {
+            ciq_accumulate(sums + 4 * a, *p, n);
+            y->upper[i] = u;
+            continue;
+        }
+
+        da = ciq_pixel_distance(*p, ctx->centroids[a]);
+        u = sqrt(da) + SLACK;
+        evaluations++;
+        for (g = 0; u >= bound && g < G; g++) {
+            if (u < l[g])
+                continue;
+            long runner = -1;       // squared distance to the nearest other member
+            for (k = y->first[g]; k < y->first[g + 1]; k++) {
+                j = y->member[k];
+                if (j == a)
+                    continue;
+                dj = ciq_pixel_distance(*p, ctx->centroids[j]);
+                evaluations++;
+                if (dj < da || (dj == da && j < a)) {
+                    // the centroid losing the point bounds its own group
+                    long loser = da;
+                    int lost = y->group[a];
+                    da = dj;
+                    a = j;
+                    u = sqrt(da) + SLACK;
+                    dj = lost == g ? loser : -1;
+                    if (lost != g && sqrt(loser) - SLACK < l[lost])
+                        l[lost] = sqrt(loser) - SLACK;
+                }
+                if (dj >= 0 && (runner < 0 || dj < runner))
+                    runner = dj;
+            }
+            l[g] = runner < 0 ? 1.0e30f : sqrt(runner) - SLACK;
+        }
+        if (a != previous) {
+            ciq_set_label(ctx, i, a);
+            changed++;
+        }
+        ciq_accumulate(sums + 4 * a, *p, n);
+        y->upper[i] = u;
     }
+    ciq_acc_release(ctx->pool, &ctx->acc, sums);
+    ciq_count(ctx->pool, &ctx->evaluations, evaluations);
+    ciq_count(ctx->pool, &ctx->changed, changed);
+}
 
-    // Open the file
-    FILE * file = fopen(filename, "rb");
-    if (!file) {
-#ifdef __DEBUG__
-        fprintf(stderr, "Unable to open file %s\n", filename);
-#endif
-        free(ctx);
-        return NULL;
+// KCIQ: group the centroids by clustering them, then sort them by group
+// The buffers are kept in the arena and in y, a new image of the same K does
+// not allocate.
+static bool ciq_yinyang_group(Context * ctx, Yinyang * y) {
+    int j, g, k, K = ctx->K, G = y->groups;
+
+    memset(y->group, 0, K * sizeof(int));
+    if (G > 1) {
+        Arena * arena = &ctx->arena;
+        Pixel * points = (Pixel *) ciq_arena_get(arena, SLOT_POINTS, K * sizeof(Pixel));
+        long * weights = (long *) ciq_arena_get(arena, SLOT_POINT_WEIGHTS, K * sizeof(long));
+        Centroid * centers = (Centroid *) ciq_arena_get(arena, SLOT_CENTERS, G * sizeof(Centroid));
+        Soa soa;
+        if (!points || !weights || !centers)
+            return false;
+        for (j = 0; j < K; j++) {
+            Centroid c = ctx->centroids[j];
+            points[j] = (Pixel) { c.r, c.g, c.b, 0 };
+            weights[j] = 1;
+        }
+        // the layout of ciq_recluster is free again once it returns
+        if (!ciq_recluster(arena, &ctx->random, points, weights, K, centers, G, 0) ||
+            !ciq_soa_borrow(&soa, arena, SLOT_RECLUSTER_LAYOUT, centers, G))
+            return false;
+        for (j = 0; j < K; j++) {
+            long distance;
+            y->group[j] = ciq_nearest(&soa, points[j].r, points[j].g, points[j].b, &distance);
+        }
     }
 
-    // Read PPM header, please note that we does not support comments here
-    char format[3];
-    int width, height, maxval;
-    fscanf(file, "%s\n%d %d\n%d\n", format, &width, &height, &maxval);
+    // counting sort of the centroids by group, in increasing index order
+    memset(y->first, 0, (G + 1) * sizeof(int));
+    for (j = 0; j < K; j++)
+        y->first[y->group[j] + 1]++;
+    for (g = 0; g < G; g++)
+        y->first[g + 1] += y->first[g];
+    for (j = 0; j < K; j++)
+        y->member[y->first[y->group[j]]++] = j;
+    for (g = G; g > 0; g--)
+        y->first[g] = y->first[g - 1];
+    y->first[0] = 0;
 
-    if (strcmp(format, "P6") != 0 || maxval != 255) {
-#ifdef __DEBUG__        
-        fprintf(stderr, "Unsupported PPM format\n");
-#endif
-        free(ctx);
-        fclose(file);
-        return false;
+    // lay the members out with the groups across the lanes, for the first pass
+    y->rows = 0;
+    for (g = 0; g < G; g++) {
+        if (y->first[g + 1] - y->first[g] > y->rows)
+            y->rows = y->first[g + 1] - y->first[g];
+    }
+    y->width = (G + LANES - 1) / LANES * LANES;
+    long cells = (long) y->rows * y->width;
+    if (cells > y->cells) {
+        if (y->r) free(y->r);
+        y->r = (float *) malloc(3 * cells * sizeof(float));
+        y->cells = y->r ? cells : 0;
+        if (!y->r) return false;
     }
+    y->g = y->r + cells;
+    y->b = y->g + cells;
+    for (long c = 0; c < cells; c++)
+        y->r[c] = y->g[c] = y->b[c] = FAR;
+    for (g = 0; g < G; g++) {
+        for (k = y->first[g]; k < y->first[g + 1]; k++) {
+            Centroid c = ctx->centroids[y->member[k]];
+            long cell = (long) (k - y->first[g]) * y->width + g;
+            y->r[cell] = (float) c.r;
+            y->g[cell] = (float) c.g;
+            y->b[cell] = (float) c.b;
+        }
+    }
+    return true;
+}
 
-    // update the context
-    ctx->width = width;
-    ctx->height = height;
-    ctx->size = width * height;
-    ctx->K = K;
+// KCIQ: assign points to the nearest centroid with Yinyang k-means (Ding et al.)
+// The groups are formed once per image, over the seeds.
+static bool ciq_yinyang(Context * ctx) {
+    Yinyang * y = ctx->yinyang;
+    int j, g, K = ctx->K;
 
+    if (!y) {
+        y = (Yinyang *) calloc(1, sizeof(Yinyang));
+        if (!y) return false;
+        y->groups = (K + GROUP_SIZE - 1) / GROUP_SIZE;
+        y->drift = (float *) malloc(K * sizeof(float));
+        y->spread = (float *) malloc(y->groups * sizeof(float));
+        y->group = (int *) malloc(K * sizeof(int));
+        y->member = (int *) malloc(K * sizeof(int));
+        y->first = (int *) malloc((y->groups + 1) * sizeof(int));
+        y->previous = (Centroid *) malloc(K * sizeof(Centroid));
+        if (!y->drift || !y->spread || !y->group || 
+            !y->member || !y->first || !y->previous) {
 #ifdef __DEBUG__
-    printf("- Image size: %dx%d\n", width, height);
-    printf("- Number of data points: %ld\n", ctx->size);
-    printf("- Number of clusters: %d\n", K);
+            fprintf(stderr, "Not enough memory for the Yinyang groups\n");
 #endif
+            ciq_yinyang_free(y);
+            return false;
+        }
+        ctx->yinyang = y;
+    }
 
-    // allocate memory for data points and centroids
-    ctx->points = (Point *) malloc(ctx->size * sizeof(Point));
-    ctx->centroids = (Centroid *) malloc(K * sizeof(Centroid));
-    if (!ctx->points || !ctx->centroids) {
+    // the bounds of the data points are kept in the arena
+    if (!y->ready) {
+        y->upper = (float *) ciq_arena_get(&ctx->arena, SLOT_UPPER, ctx->count * sizeof(float));
+        y->lower = (float *) ciq_arena_get(&ctx->arena, SLOT_LOWER, ctx->count * y->groups * sizeof(float));
+        if (!y->upper || !y->lower || !ciq_yinyang_group(ctx, y)) {
 #ifdef __DEBUG__
-        fprintf(stderr, "Memory allocation failed\n");
+            fprintf(stderr, "Not enough memory for the Yinyang bounds\n");
+#endif
+            return false;
+        }
+#ifdef __DEBUG__
+        printf("- Number of Yinyang groups: %d\n", y->groups);
 #endif
-        if (ctx->points) free(ctx->points);
-        if (ctx->centroids) free(ctx->centroids);
-        free(ctx);
-        fclose(file);
-        return NULL;
-    }
-    else {
-        memset(ctx->points, 0, ctx->size * sizeof(Point));
-        memset(ctx->centroids, 0, K * sizeof(Centroid));
-#ifdef  __DEBUG__
-        printf("- Allocated %lu bytes for the data points\n", ctx->size * sizeof(Point));
-        printf("- Allocated %lu bytes for the centroids\n", K * sizeof(Centroid));
-#endif        
     }
 
-    // read the image data
-    for (int i = 0; i < ctx->size; i++) {
-        unsigned char r, g, b;
-        fread(&r, 1, 1, file);
-        fread(&g, 1, 1, file);
-        fread(&b, 1, 1, file);
-        ctx->points[i] = (Point) {r, g, b, -1};
+    // distances moved by the centroids, each step rounded up by the slack
+    for (g = 0; g < y->groups; g++)
+        y->spread[g] = 0;
+    for (j = 0; j < K; j++) {
+        y->drift[j] = y->ready ? sqrt(ciq_distance(y->previous[j], ctx->centroids[j])) + SLACK : 0;
+        if (y->drift[j] > y->spread[y->group[j]])
+            y->spread[y->group[j]] = y->drift[j];
     }
 
-    fclose(file);   // close the file
-    return ctx;     // return the context
+    ctx->evaluations = 0;
+    ciq_parallel(ctx->pool, ciq_yinyang_task, ctx, ctx->count);
+    memcpy(y->previous, ctx->centroids, K * sizeof(Centroid));
+    y->ready = true;
+    return true;
 }
 
-// KCIQ: K-means++ initialization
-bool ciq_init_centroids(Context * ctx) {
-
-    if (!ctx) return false;
+// KCIQ: nearest candidate to a color, the lowest index wins ties
+static int ciq_kdtree_nearest(const Pixel * p, const Centroid * c, const int * cand, int n) {
+    int k, nearest = cand[0];
+    long mindist = ciq_pixel_distance(*p, c[nearest]), curdist;
 
-    int i, j;
-    int chosen_index;
-    long total_distance, random_choice, cumulative_probability;
-    long *distances = (long *) malloc(ctx->size * sizeof(long));
+    for (k = 1; k < n; k++) {
+        curdist = ciq_pixel_distance(*p, c[cand[k]]);
+        if (curdist < mindist) {
+            mindist = curdist;
+            nearest = cand[k];
+        }
+    }
+    return nearest;
+}
 
-    if (!distances)
-        return false;
+// KCIQ: filter the candidate centroids of a node, in increasing index order
+// Candidate z is dropped when the corner of the box furthest in the direction
+// of z - z* is strictly closer to z*, z* being the candidate closest to the
+// middle of the box: every color of the box is then strictly closer to z*.
+static void ciq_kdtree_filter(Context * ctx, int index, const Centroid * c, int * cand, int n, bool label) {
+    KdTree * t = ctx->kdtree;
+    KdNode * node = &t->nodes[index];
+    int k, best = 0;
+    long i, mindist = -1;
 
-    // Choose the first centroid randomly
-    chosen_index = rand() % ctx->size;
-    ctx->centroids[0] = (Centroid){ ctx->points[chosen_index].r, 
-                                    ctx->points[chosen_index].g, 
-                                    ctx->points[chosen_index].b};
-#ifdef __DEBUG__
-    printf("- Initial centroid: (%d, %d, %d)\n", 
-            ctx->centroids[0].r, ctx->centroids[0].g, ctx->centroids[0].b);
-#endif
+    // candidate closest to the middle of the box, in doubled coordinates
+    for (k = 0; k < n; k++) {
+        const Centroid * z = &c[cand[k]];
+        long dr = 2 * z->r - node->lo[0] - node->hi[0];
+        long dg = 2 * z->g - node->lo[1] - node->hi[1];
+        long db = 2 * z->b - node->lo[2] - node->hi[2];
+        long dist = dr*dr + dg*dg + db*db;
+        if (mindist < 0 || dist < mindist) {
+            mindist = dist;
+            best = cand[k];
+        }
+    }
 
-    // Choose the remaining centroids
-    for (i = 1; i < ctx->K; i++) {
-        total_distance = 0.0;
-        for (j = 0; j < ctx->size; j++) {
-            distances[j] = ciq_distance(ctx->points[j], ctx->centroids[i - 1]);
-            total_distance += distances[j];
+    int * next = cand + ctx->K;
+    int m = 0;
+    for (k = 0; k < n; k++) {
+        const Centroid * z = &c[cand[k]];
+        const Centroid * zs = &c[best];
+        if (cand[k] != best) {
+            Centroid corner = { z->r > zs->r ? node->hi[0] : node->lo[0],
+                                z->g > zs->g ? node->hi[1] : node->lo[1],
+                                z->b > zs->b ? node->hi[2] : node->lo[2] };
+            ctx->evaluations += 2;
+            if (ciq_distance(corner, *z) > ciq_distance(corner, *zs))
+                continue;
         }
+        next[m++] = cand[k];
+    }
 
-        random_choice = ((double) rand() / RAND_MAX) * total_distance;
-        cumulative_probability = 0.0;
-        for (j = 0; j < ctx->size; j++) {
-            cumulative_probability += distances[j];
-            if (cumulative_probability >= random_choice) {
-                ctx->centroids[i] = (Centroid){ ctx->points[j].r, 
-                                                ctx->points[j].g, 
-                                                ctx->points[j].b};
-#ifdef __DEBUG__
-                printf("- Centroid %3d: (%d, %d, %d)\n", i,
-                        ctx->centroids[i].r, ctx->centroids[i].g, ctx->centroids[i].b);
-#endif                                                
-                break;
-            }
+    // a single candidate left, the whole box belongs to it
+    if (m == 1) {
+        t->cluster_size[next[0]] += node->count;
+        t->sum_r[next[0]] += node->sum[0];
+        t->sum_g[next[0]] += node->sum[1];
+        t->sum_b[next[0]] += node->sum[2];
+        if (label) {
+            for (i = node->begin; i < node->end; i++)
+                ciq_set_label(ctx, t->order[i], next[0]);
         }
+        return;
     }
-    free(distances);
-    return true;
-}
 
-// KCIQ: assign points to the nearest centroid
-void ciq_clustering(Context * ctx) {
-    int i, j;
-    long mindist, curdist;
+    if (node->left >= 0) {
+        ciq_kdtree_filter(ctx, node->left, c, next, m, label);
+        ciq_kdtree_filter(ctx, node->right, c, next, m, label);
+        return;
+    }
 
-    if (!ctx) return;    
-    for (i = 0; i < ctx->size; i++) {
-        mindist = ciq_distance(ctx->points[i], ctx->centroids[0]);
-        ctx->points[i].cluster = 0;
-        for (j = 1; j < ctx->K; j++) {
-            curdist = ciq_distance(ctx->points[i], ctx->centroids[j]);
-            if (curdist < mindist) {
-                mindist = curdist;
-                ctx->points[i].cluster = j;
-            }
-        }
+    // leaf, assign its data points one by one
+    for (i = node->begin; i < node->end; i++) {
+        const Pixel * p = &ctx->data[t->order[i]];
+        long w = ctx->weights ? ctx->weights[t->order[i]] : 1;
+        int j = ciq_kdtree_nearest(p, c, next, m);
+        t->cluster_size[j] += w;
+        t->sum_r[j] += w * p->r;
+        t->sum_g[j] += w * p->g;
+        t->sum_b[j] += w * p->b;
+        if (label) ciq_set_label(ctx, t->order[i], j);
+        ctx->evaluations += m;
     }
 }
 
-// KCIQ: update centroids based on assigned points
-bool ciq_update_centroids(Context * ctx) {
-    
-    if (!ctx) return false;
-    
-    Centroid new;
-    int i, j, cluster_size[ctx->K];
-    long sum_r[ctx->K], sum_g[ctx->K], sum_b[ctx->K];
-    double w[ctx->K];
-    bool changed = false;
+// KCIQ: accumulate the clusters with the filtering algorithm
+static void ciq_kdtree(Context * ctx, const Centroid * c, bool label) {
+    KdTree * t = ctx->kdtree;
+    int K = ctx->K;
+
+    memset(t->cluster_size, 0, K * sizeof(long));
+    memset(t->sum_r, 0, K * sizeof(long));
+    memset(t->sum_g, 0, K * sizeof(long));
+    memset(t->sum_b, 0, K * sizeof(long));
+    for (int j = 0; j < K; j++)
+        t->scratch[j] = j;
+
+    ctx->evaluations = 0;
+    ciq_kdtree_filter(ctx, 0, c, t->scratch, K, label);
+}
 
-    // reset the sums and cluster sizes
-    memset(sum_r, 0, sizeof(sum_r));
-    memset(sum_g, 0, sizeof(sum_g));
-    memset(sum_b, 0, sizeof(sum_b));
-    memset(cluster_size, 0, sizeof(cluster_size));
+// KCIQ: label the data points with the centroids of the last filtering pass
+static void ciq_kdtree_label(Context * ctx) {
+    if (ctx->algorithm == CIQ_KDTREE)
+        ciq_kdtree(ctx, ctx->kdtree->previous, true);
+}
 
-    // calculate the sums and cluster sizes
-    for (i = 0; i < ctx->size; i++) {
-        j = ctx->points[i].cluster;
-        sum_r[j] += ctx->points[i].r;
-        sum_g[j] += ctx->points[i].g;
-        sum_b[j] += ctx->points[i].b;
-        cluster_size[j]++;
+// KCIQ: assign points to the nearest centroid
+// The filtering algorithm only accumulates the clusters, the labels are
+// written once by ciq_kdtree_label() when the centroids are final.
+static void ciq_clustering(Context * ctx) {
+    if (!ctx) return;    
+    ciq_sync_centroids(ctx);
+    ciq_acc_reset(&ctx->acc);
+    ctx->changed = 0;
+    if (ctx->algorithm == CIQ_ELKAN) {
+        if (ciq_elkan(ctx))
+            return;
+        ctx->algorithm = CIQ_LLOYD;     // not enough memory, fall back to brute force
     }
+    if (ctx->algorithm == CIQ_YINYANG) {
+        if (ciq_yinyang(ctx))
+            return;
+        ctx->algorithm = CIQ_LLOYD;
+    }
+    if (ctx->algorithm == CIQ_KDTREE) {
+        memcpy(ctx->kdtree->previous, ctx->centroids, ctx->K * sizeof(Centroid));
+        ciq_kdtree(ctx, ctx->centroids, false);
+        ctx->changed = -1;      // whole nodes are assigned, no point is looked at
+        return;
+    }
+    ctx->evaluations = ctx->count * ctx->K;
+    ciq_parallel(ctx->pool, ciq_clustering_task, ctx, ctx->count);
+    ctx->assigned = true;
+}
 
-    // calculate the factor per cluster
-    for (i = 0; i < ctx->K; i++)
-        w[i] = 1.0 / cluster_size[i];
+// KCIQ: move the centroids to the mean of their cluster
+// The SSE of the assignment to these means comes with the sums: it is the
+// energy of the points minus |sum|^2 / size per cluster, no distance needed.
+static bool ciq_move_centroids(Context * ctx, const long * cluster_size, 
+                               const long * sum_r, const long * sum_g, const long * sum_b) {
+    Centroid new;
+    int i;
+    bool changed = false;
+    double sse = ctx->energy;
+    ctx->empty = 0;
 
-    // update the centroids
+    // update the centroids, an empty cluster keeps its centroid
     for (i = 0; i < ctx->K; i++) {
+        new = ctx->centroids[i];
         if (cluster_size[i] > 0) {
-            new.r = w[i] * sum_r[i];
-            new.g = w[i] * sum_g[i];
-            new.b = w[i] * sum_b[i];
+            double w = 1.0 / cluster_size[i];
+            new.r = w * sum_r[i];
+            new.g = w * sum_g[i];
+            new.b = w * sum_b[i];
+            sse -= w * ((double) sum_r[i] * sum_r[i] + (double) sum_g[i] * sum_g[i] +
+                        (double) sum_b[i] * sum_b[i]);
         }
+        else
+            ctx->empty++;
         // check if the centroid has changed
-        if (ciq_distance(ctx->centroids[i], new) > EPSILON) {
+        if (ciq_distance(ctx->centroids[i], new) > ctx->tolerance) {
             changed = true;
         }
         // update the current centroid
         ctx->centroids[i] = new;
     }
+    ctx->sse = sse > 0 ? sse : 0;
     return changed;
 }
 
-// KCIQ: free memory
-void ciq_shutdown(Context * ctx) {
-    if (!ctx) return;
-    if (ctx->points) 
-        free(ctx->points);
-    if (ctx->centroids)
-        free(ctx->centroids);
-    free(ctx);
+// KCIQ: update centroids based on assigned points
+static bool ciq_update_centroids(Context * ctx) {
+    
+    if (!ctx) return false;
+
+    // the filtering algorithm already reduced the clusters over the tree
+    if (ctx->algorithm == CIQ_KDTREE) {
+        KdTree * t = ctx->kdtree;
+        return ciq_move_centroids(ctx, t->cluster_size, t->sum_r, t->sum_g, t->sum_b);
+    }
+    
+    // the assignment pass gathered the sums, reduce its replicas
+    Accumulator * acc = &ctx->acc;
+    ciq_acc_reduce(acc, ctx->K);
+    return ciq_move_centroids(ctx, acc->cluster_size, acc->sum_r, acc->sum_g, acc->sum_b);
 }
 
-// KCIQ: perform k-means clustering for image quantization
-bool ciq_quantize(Context * ctx) {
+// KCIQ: clear the statistics of the previous image but its loading time
+static bool ciq_start_stats(Context * ctx) {
+    int passes = ctx->batch > 0 ? ctx->batches : ctx->iterations;
+    ctx->passes = (Pass *) ciq_arena_get(&ctx->arena, SLOT_PASSES, passes * sizeof(Pass));
+    if (!ctx->passes) return false;
+    double load = ctx->stats.load;
+    memset(&ctx->stats, 0, sizeof(Stats));
+    ctx->stats.load = load;
+    ctx->stats.pass = ctx->passes;
+    ctx->stats.algorithm = ctx->algorithm;
+    ctx->assigned = false;
+    return true;
+}
+
+// KCIQ: add an iteration to the statistics
+static void ciq_record(Context * ctx, double assignment, double update, long changed, int empty, double sse) {
+    Stats * s = &ctx->stats;
+    Pass * p = &ctx->passes[s->passes++];
+    p->assignment = assignment;
+    p->update = update;
+    p->evaluations = ctx->evaluations;
+    p->changed = changed;
+    p->empty = empty;
+    p->sse = sse;
+    s->assignment += assignment;
+    s->update += update;
+    s->evaluations += ctx->evaluations;
+    if (s->changed >= 0)
+        s->changed = changed >= 0 ? s->changed + changed : -1;
+}
+
+// KCIQ: time ciq_finish still needs, for the time budget
+// An inverse colormap cell, like a point labeled after the mini-batches, costs
+// K distances, the labels of the kd-tree one more filtering pass.
+static double ciq_finish_time(const Context * ctx, double pass, double distance) {
+    if (ctx->lut_bits > 0)
+        return distance * (double) (1L << 3 * ctx->lut_bits) * ctx->K;
+    if (ctx->batch > 0)
+        return distance * (double) ctx->count * ctx->K;
+    return ctx->algorithm == CIQ_KDTREE ? pass : 0;
+}
+
+// KCIQ: estimate the time of a distance, from the data points of a chunk
+// The points are assigned by the calling thread, the passes by every thread.
+static double ciq_distance_time(Context * ctx) {
+    long n = ctx->count < CHUNK_SIZE ? ctx->count : CHUNK_SIZE, distance;
+    ciq_sync_centroids(ctx);
+    double start = ciq_seconds();
+    for (long j = 0; j < n; j++)
+        ciq_nearest(&ctx->soa, ctx->data[j].r, ctx->data[j].g, ctx->data[j].b, &distance);
+    return (ciq_seconds() - start) / n / ctx->K / ctx->pool->threads;
+}
+
+// KCIQ: assign the points [begin, end) of the batch to the nearest centroid
+static void ciq_minibatch_task(void * arg, long begin, long end) {
+    Context * ctx = (Context *) arg;
+    MiniBatch * m = ctx->minibatch;
+    Nearest nearest = ciq_nearest;
+    long distance;
+
+    for (long k = begin; k < end; k++) {
+        const Pixel * p = &ctx->data[m->points[k]];
+        m->nearest[k] = nearest(&ctx->soa, p->r, p->g, p->b, &distance);
+    }
+}
+
+// KCIQ: mini-batch k-means (Sculley)
+// Each batch samples pixels uniformly, assigns them in parallel to the current
+// centroids, then moves every centroid towards its points with a learning rate
+// of 1 / (points assigned to it so far). The work depends on the number of
+// batches rather than the image size; the labels are set by ciq_remap.
+static bool ciq_minibatch(Context * ctx, double distance) {
+    MiniBatch * m = ctx->minibatch;
+    if (!m) {
+        m = (MiniBatch *) calloc(1, sizeof(MiniBatch));
+        if (!m) return false;
+        ctx->minibatch = m;
+
+        m->points = (long *) malloc(ctx->batch * sizeof(long));
+        m->nearest = (int *) malloc(ctx->batch * sizeof(int));
+        m->centers = (double *) malloc(3 * ctx->K * sizeof(double));
+        m->seen = (long *) malloc(ctx->K * sizeof(long));
+        if (!m->points || !m->nearest || !m->centers || !m->seen) {
+#ifdef __DEBUG__
+            fprintf(stderr, "Memory allocation failed\n");
+#endif
+            return false;
+        }
+    }
+    memset(m->seen, 0, ctx->K * sizeof(long));
+
+    for (int i = 0; i < ctx->K; i++) {
+        m->centers[3 * i] = ctx->centroids[i].r;
+        m->centers[3 * i + 1] = ctx->centroids[i].g;
+        m->centers[3 * i + 2] = ctx->centroids[i].b;
+    }
+
+    // time of a batch, estimated before the first one so that it leaves time
+    // for ciq_finish
+    double pass = distance * ctx->batch * ctx->K;
+    for (int t = 0; t < ctx->batches; t++) {
+        if (ciq_expired(ctx->deadline, pass + ciq_finish_time(ctx, pass, distance)))
+            break;
+        double start = ciq_seconds();
+        if (ctx->verbose)
+            printf("Batch: %d\r", t + 1);
+
+        // sample pixels, so the unique colors are drawn by their pixel count
+        for (long k = 0; k < ctx->batch; k++) {
+            long j = ciq_random_below(&ctx->random, ctx->size);
+            m->points[k] = ctx->index ? ctx->index[j] : j;
+        }
+        ciq_sync_centroids(ctx);
+        ciq_parallel(ctx->pool, ciq_minibatch_task, ctx, ctx->batch);
+        double assigned = ciq_seconds();
+
+        // gradient steps, in batch order
+        for (long k = 0; k < ctx->batch; k++) {
+            int i = m->nearest[k];
+            const Pixel * p = &ctx->data[m->points[k]];
+            double rate = 1.0 / ++m->seen[i];
+            double * c = m->centers + 3 * i;
+            c[0] += rate * (p->r - c[0]);
+            c[1] += rate * (p->g - c[1]);
+            c[2] += rate * (p->b - c[2]);
+        }
+        for (int i = 0; i < ctx->K; i++) {
+            const double * c = m->centers + 3 * i;
+            ctx->centroids[i] = (Centroid){ (int) (c[0] + 0.5), (int) (c[1] + 0.5), (int) (c[2] + 0.5) };
+        }
+        ctx->evaluations = ctx->batch * ctx->K;
+        ciq_record(ctx, assigned - start, ciq_seconds() - assigned, -1, -1, -1);
+        pass = ciq_seconds() - start;
+        if (ctx->verbose)
+            fflush(stdout);
+    }
+    if (ctx->verbose)
+        printf("\n");
+    ctx->labeled = false;
+    return true;
+}
+
+// KCIQ: seed the centroids from the seed of the context and iterate
+// With a time budget, the iterations stop once the next one and ciq_finish
+// would not fit in it anymore, the centroids so far are the palette.
+static bool ciq_solve(Context * ctx) {
     int i;
 
-    if (!ctx) return false;    
-    if (!ciq_init_centroids(ctx))
+    ctx->labeled = false;
+    ctx->lut_ready = false;
+    ctx->algorithm = ctx->requested;    // a fallback only holds for its image
+    if (ctx->elkan) {
+        ctx->elkan->ready = false;
+        memset(ctx->elkan->moved, 0, ctx->K * sizeof(float));
+    }
+    if (ctx->yinyang)
+        ctx->yinyang->ready = false;
+    if (!ciq_start_stats(ctx))
+        return false;
+    ciq_random_seed(&ctx->random, ctx->seed);
+    double start = ciq_seconds();
+    bool seeded = ciq_init_centroids(ctx);
+    ctx->stats.seeding = ciq_seconds() - start;
+    if (!seeded)
         return false;
+    double distance = ctx->deadline > 0 ? ciq_distance_time(ctx) : 0;
+    ctx->distance_time = distance;
+    if (ctx->batch > 0)
+        return ciq_minibatch(ctx, distance);
+
+    // energy of the points, for the SSE of each iteration
+    ctx->energy = 0;
+    for (long j = 0; j < ctx->count; j++) {
+        const Pixel * p = &ctx->data[j];
+        double norm = (double) p->r * p->r + (double) p->g * p->g + (double) p->b * p->b;
+        ctx->energy += ctx->weights ? ctx->weights[j] * norm : norm;
+    }
 
-    for (i = 0; i < MAX_ITERS; i++) {  
-        printf("Iteration: %d\r", i+1);
+    // time of the last iteration, the first one always runs for the labels
+    double pass = 0, previous = 0;
+    for (i = 0; i < ctx->iterations; i++) {  
+        if (i > 0 && ciq_expired(ctx->deadline, pass + ciq_finish_time(ctx, pass, distance))) {
+#ifdef __DEBUG__
+            printf("\n- Out of time after %d iterations\n", i);
+#endif
+            break;
+        }
+        start = ciq_seconds();
+        if (ctx->verbose)
+            printf("Iteration: %d\r", i+1);
         ciq_clustering(ctx);
+        double assigned = ciq_seconds();
+        if (ctx->verbose && ctx->algorithm != CIQ_LLOYD)
+            printf("Iteration: %d, distances saved: %-12ld\r", i+1,
+                   ctx->count * ctx->K - ctx->evaluations);
+#ifdef __DEBUG__
+        printf("\n- %ld distances computed, %ld saved\n", ctx->evaluations,
+               ctx->count * ctx->K - ctx->evaluations);
+#endif
         bool changed = ciq_update_centroids(ctx);
+        ciq_record(ctx, assigned - start, ciq_seconds() - assigned, ctx->changed, ctx->empty, ctx->sse);
+        pass = ciq_seconds() - start;
+#ifdef __DEBUG__
+        printf("- SSE: %.0f\n", ctx->sse);
+#endif
+        // stable centroids, or an SSE that hardly improves anymore
+        if (ctx->improvement > 0 && i > 0 && previous - ctx->sse <= ctx->improvement * previous)
+            changed = false;
+        previous = ctx->sse;
         if (!changed) {
 #ifdef __DEBUG__
         if (!changed)
@@ -266,103 +2832,371 @@ bool ciq_quantize(Context * ctx) {
 #endif            
             break;
         }
-        fflush(stdout);
+        if (ctx->verbose)
+            fflush(stdout);
     }
-    printf("\n");
+    if (ctx->verbose)
+        printf("\n");
+    ctx->stats.algorithm = ctx->algorithm;
+    ctx->stats.fallback = ctx->algorithm != ctx->requested;
+    start = ciq_seconds();
+    ciq_kdtree_label(ctx);
+    ctx->stats.remap += ciq_seconds() - start;
+    ctx->labeled = true;
     return true;
 }
 
-// KCIQ: remap the image using the quantized palette
-bool ciq_remap(Context * ctx, const char * filename) {
-    if (!ctx) return false;
+// KCIQ: create the context of a restart, sharing the image of ctx
+// It only owns its centroids, cluster sums and arena, the pixels, the unique
+// colors and the kd-tree nodes are read from ctx.
+static Context * ciq_restart_create(const Context * ctx) {
+    Context * run = (Context *) malloc(sizeof(Context));
+    if (!run) return NULL;
+    *run = *ctx;
+    run->centroids = NULL;
+    memset(&run->soa, 0, sizeof(Soa));
+    memset(&run->acc, 0, sizeof(Accumulator));
+    memset(&run->arena, 0, sizeof(Arena));
+    run->elkan = NULL;
+    run->yinyang = NULL;
+    run->kdtree = NULL;
+    run->minibatch = NULL;
+    run->lut = NULL;
+    run->runs = NULL;
+    run->restarts = 1;
+    run->shared = true;
+    run->verbose = false;
 
-    FILE *file = fopen(filename, "wb");
-    if(!file) {
-#ifdef __DEBUG__
-        fprintf(stderr, "Unable to create file %s\n", filename);
-#endif
-        return false;
+    run->centroids = (Centroid *) calloc(ctx->K, sizeof(Centroid));
+    if (!run->centroids || !ciq_soa_init(&run->soa, run->centroids, ctx->K) ||
+        !ciq_acc_init(&run->acc, ctx->pool->threads, ctx->K)) {
+        ciq_shutdown(run);
+        return NULL;
     }
+    return run;
+}
+
+// KCIQ: point a restart to the image loaded into ctx
+static bool ciq_restart_load(Context * run, const Context * ctx) {
+    run->width = ctx->width;
+    run->height = ctx->height;
+    run->size = ctx->size;
+    run->pixels = ctx->pixels;
+    run->data = ctx->data;
+    run->weights = ctx->weights;
+    run->count = ctx->count;
+    run->colors = ctx->colors;
+    run->index = ctx->index;
+    run->algorithm = ctx->algorithm;
+    run->deadline = ctx->deadline;
+    run->stats.load = 0;
+    run->labels = ciq_arena_get(&run->arena, SLOT_LABELS, run->count * run->label_size);
+    if (!run->labels)
+        return false;
 
-    fprintf(file, "P6\n%d %d\n255\n", ctx->width, ctx->height);
+    // the filtering reads the nodes of the tree, only its sums are per run
+    if (run->algorithm == CIQ_KDTREE) {
+        if (!run->kdtree)
+            run->kdtree = ciq_kdtree_create(run->K);
+        if (!run->kdtree)
+            return false;
+        run->kdtree->nodes = ctx->kdtree->nodes;
+        run->kdtree->size = ctx->kdtree->size;
+        run->kdtree->order = ctx->kdtree->order;
+        run->kdtree->borrowed = true;
+    }
+    return true;
+}
 
-    for (int i = 0; i < ctx->size; i++) {
-        Centroid c = ctx->centroids[ctx->points[i].cluster];
-        unsigned char r = c.r;
-        unsigned char g = c.g;
-        unsigned char b = c.b;
-        fwrite(&r, 1, 1, file);
-        fwrite(&g, 1, 1, file);
-        fwrite(&b, 1, 1, file);
+// KCIQ: run the restarts [begin, end), each one seeded differently
+// A restart that would start past the deadline is skipped, but the first one
+// always runs so that there is a palette.
+static void ciq_restart_task(void * arg, long begin, long end) {
+    Context ** runs = (Context **) arg;
+    for (long r = begin; r < end; r++) {
+        if (r > 0 && ciq_expired(runs[r]->deadline, 0))
+            runs[r]->labeled = false;
+        else
+            ciq_solve(runs[r]);
     }
+}
 
-    fclose(file);
+// KCIQ: take the palette, labels and statistics of a restart
+// The labels are swapped with those of the restart rather than copied.
+static void ciq_restart_adopt(Context * ctx, Context * run) {
+    Arena * a = &ctx->arena, * b = &run->arena;
+    void * labels = a->data[SLOT_LABELS];
+    size_t capacity = a->capacity[SLOT_LABELS];
+    a->data[SLOT_LABELS] = b->data[SLOT_LABELS];
+    a->capacity[SLOT_LABELS] = b->capacity[SLOT_LABELS];
+    b->data[SLOT_LABELS] = labels;
+    b->capacity[SLOT_LABELS] = capacity;
+    ctx->labels = a->data[SLOT_LABELS];
+    run->labels = labels;
 
-    // write the palette file
-    file = fopen("palette.pal", "wb");
-    if (!file) {
+    memcpy(ctx->centroids, run->centroids, ctx->K * sizeof(Centroid));
+    memcpy(ctx->passes, run->passes, run->stats.passes * sizeof(Pass));
+    double load = ctx->stats.load;
+    ctx->stats = run->stats;
+    ctx->stats.load = load;
+    ctx->stats.pass = ctx->passes;
+    ctx->sse = run->sse;
+    ctx->evaluations = run->evaluations;
+    ctx->changed = run->changed;
+    ctx->empty = run->empty;
+}
+
+// KCIQ: run the restarts concurrently and keep the one with the lowest SSE
+// Each restart is a single chunk, so the threads of the pool spread over the
+// restarts and the chunks of their assignment passes. The first restart is
+// ctx with its own seed, the others add their number to it, so the palette
+// does not depend on the number of threads.
+static bool ciq_restart(Context * ctx) {
+    int r, best = -1;
+
+    if (!ctx->runs) {
+        ctx->runs = (Context **) calloc(ctx->restarts, sizeof(Context *));
+        if (!ctx->runs) return false;
+        ctx->runs[0] = ctx;
+    }
+    for (r = 1; r < ctx->restarts; r++) {
+        if (!ctx->runs[r])
+            ctx->runs[r] = ciq_restart_create(ctx);
+        if (!ctx->runs[r] || !ciq_restart_load(ctx->runs[r], ctx)) {
 #ifdef __DEBUG__
-        fprintf(stderr, "Unable to create file palette.pal\n");
+            fprintf(stderr, "Not enough memory for the restarts\n");
 #endif
-        return false;
+            return false;
+        }
+        ctx->runs[r]->seed = ctx->seed + r;
     }
 
-    for (int i = 0; i < ctx->K; i++) {
-        Centroid c = ctx->centroids[i];
-        unsigned char r = c.r;
-        unsigned char g = c.g;
-        unsigned char b = c.b;
-        fwrite(&r, 1, 1, file);
-        fwrite(&g, 1, 1, file);
-        fwrite(&b, 1, 1, file);
-    }
-    fclose(file);
+    ciq_parallel_chunks(ctx->pool, ciq_restart_task, ctx->runs, ctx->restarts, 1);
+    for (r = 0; r < ctx->restarts; r++) {
+        Context * run = ctx->runs[r];
+#ifdef __DEBUG__
+        printf("- Restart %d: SSE %.0f\n", r, run->sse);
+#endif
+        if (run->labeled && (best < 0 || run->sse < ctx->runs[best]->sse))
+            best = r;
+    }
+    if (best < 0)
+        return false;
+    if (best > 0)
+        ciq_restart_adopt(ctx, ctx->runs[best]);
     return true;
 }
 
-// KCIQ: main function for image quantization
-bool ciq_quanization(const char * input, const char * output, int K) {
-    Context * ctx = ciq_init(input, K);
-    if (!ctx) {
+// KCIQ: perform k-means clustering for image quantization
+// Mini-batches have no SSE to compare, they ignore the restarts.
+bool ciq_quantize(Context * ctx) {
+    if (!ctx) return false;
+    ctx->deadline = ctx->budget > 0 ? ciq_seconds() + ctx->budget / 1000.0 : 0;
+    if (ctx->restarts > 1 && ctx->batch == 0)
+        return ciq_restart(ctx);
+    return ciq_solve(ctx);
+}
+
+// KCIQ: fill the options with their defaults
+void ciq_options(Options * opts) {
+    opts->K = 256;
+    opts->threads = 1;
+    opts->histogram = false;
+    opts->algorithm = CIQ_LLOYD;
+    opts->seeding = CIQ_KMEANSPP;
+    opts->chain = CHAIN;
+    opts->batch = 0;
+    opts->batches = BATCHES;
+    opts->lut = 0;
+    opts->deadline = 0;
+    opts->iterations = MAX_ITERS;
+    opts->tolerance = EPSILON;
+    opts->improvement = 0;
+    opts->seed = SEED;
+    opts->restarts = 1;
+    opts->pool = NULL;
+    opts->verbose = false;
+}
+
+// KCIQ: Define the names of the algorithms and seedings, in enum order
+static const char * algorithm_names[] = { "lloyd", "elkan", "kdtree", "yinyang" };
+static const char * seeding_names[] = { "kmeans++", "kmeans||", "afkmc2" };
+
+// KCIQ: name of an algorithm, NULL for an unknown one
+const char * ciq_algorithm_name(Algorithm algorithm) {
+    return (unsigned) algorithm <= CIQ_YINYANG ? algorithm_names[algorithm] : NULL;
+}
+
+// KCIQ: name of a seeding, NULL for an unknown one
+const char * ciq_seeding_name(Seeding seeding) {
+    return (unsigned) seeding <= CIQ_AFKMC2 ? seeding_names[seeding] : NULL;
+}
+
+// KCIQ: find an algorithm by name
+bool ciq_parse_algorithm(const char * name, Algorithm * algorithm) {
+    for (int i = 0; i <= CIQ_YINYANG; i++) {
+        if (strcmp(name, algorithm_names[i]) == 0) {
+            *algorithm = (Algorithm) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// KCIQ: find a seeding by name
+bool ciq_parse_seeding(const char * name, Seeding * seeding) {
+    for (int i = 0; i <= CIQ_AFKMC2; i++) {
+        if (strcmp(name, seeding_names[i]) == 0) {
+            *seeding = (Seeding) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+// KCIQ: build the inverse colormap of the palette unless it is up to date
+static bool ciq_build_lut(Context * ctx, int bits) {
+    if (ctx->lut && ctx->lut_ready && ctx->lut->bits == bits) return true;
+#ifdef __DEBUG__
+    double start = ciq_seconds();
+#endif
+    if (ctx->lut && ctx->lut->bits != bits) {
+        ciq_lut_free(ctx->lut);
+        ctx->lut = NULL;
+    }
+    if (!ctx->lut)
+        ctx->lut = ciq_lut_create(bits);
+    if (!ctx->lut) {
 #ifdef __DEBUG__
-        fprintf(stderr, "Failed to initialize context\n");
-#endif        
+        fprintf(stderr, "Unable to build the inverse colormap\n");
+#endif
         return false;
     }
-    ciq_quantize(ctx);
-    if (ciq_remap(ctx, output)) {
+    ciq_lut_fill(ctx->pool, ctx->lut, ctx->centroids, ctx->K);
+    ctx->lut_ready = true;
 #ifdef __DEBUG__
-        printf("Image quantized successfully and saved into %s\n", output);
-#endif        
-    } else {
-#ifdef  __DEBUG__        
-        fprintf(stderr, "Failed to quantize image\n");
-#endif        
+    printf("- Inverse colormap of %d cells built in %.2f ms\n", 1 << 3 * bits,
+           1000 * (ciq_seconds() - start));
+#endif
+    return true;
+}
+
+// KCIQ: make the palette index of every pixel available
+static bool ciq_finish(Context * ctx) {
+    // map the pixels through the inverse colormap instead of their labels,
+    // a coarser one when the requested one would end past the deadline
+    if (ctx->lut_bits > 0) {
+        if (ctx->lut && ctx->lut_ready && ctx->lut->bits <= ctx->lut_bits) return true;
+        int bits = ctx->lut_bits;
+        while (bits > MIN_LUT &&
+               ciq_expired(ctx->deadline, ctx->distance_time * (double) (1L << 3 * bits) * ctx->K))
+            bits--;
+        return ciq_build_lut(ctx, bits);
+    }
+
+    // mini-batches leave the full assignment to a single final pass
+    if (!ctx->labeled) {
+        ciq_sync_centroids(ctx);
+        ciq_acc_reset(&ctx->acc);
+        ciq_parallel(ctx->pool, ciq_clustering_task, ctx, ctx->count);
+        ctx->labeled = true;
     }
-    ciq_shutdown(ctx);
     return true;
 }
 
-int main(int argc, char *argv[]) {
-    printf("Color Image Quantization using K-Means++ - v0.1\n");
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <input.ppm> <output.ppm> [K]\n", argv[0]);
-        return 1;
+// KCIQ: palette index of the pixel i
+static int ciq_pixel_index(const Context * ctx, long i) {
+    if (ctx->lut_bits > 0) {
+        Pixel p = ctx->pixels[i];
+        return ciq_lut_lookup(ctx->lut, p.r, p.g, p.b);
     }
+    return ciq_label(ctx, ctx->index ? ctx->index[i] : i);
+}
 
-    char input[256];
-    char output[256];
-    int K = argv[3] ? atoi(argv[3]) : 256;
-    
-    strcpy(input, argv[1]);
-    strcpy(output, argv[2]);
+// KCIQ: copy the palette as K RGB triples
+int ciq_palette(const Context * ctx, unsigned char * palette) {
+    if (!ctx) return 0;
+    if (!palette) return ctx->K;
+    for (int i = 0; i < ctx->K; i++, palette += 3) {
+        Centroid c = ctx->centroids[i];
+        palette[0] = c.r;
+        palette[1] = c.g;
+        palette[2] = c.b;
+    }
+    return ctx->K;
+}
+
+// KCIQ: size in bytes of a palette index
+int ciq_index_size(const Context * ctx) {
+    return ctx ? ctx->label_size : 0;
+}
+
+// KCIQ: write the palette index of every pixel
+bool ciq_indices(Context * ctx, void * indices) {
+    if (!ctx) return false;
+    double start = ciq_seconds();
+    if (!ciq_finish(ctx)) return false;
+    if (ctx->label_size == 1) {
+        unsigned char * out = (unsigned char *) indices;
+        for (long i = 0; i < ctx->size; i++)
+            out[i] = (unsigned char) ciq_pixel_index(ctx, i);
+    }
+    else {
+        unsigned short * out = (unsigned short *) indices;
+        for (long i = 0; i < ctx->size; i++)
+            out[i] = (unsigned short) ciq_pixel_index(ctx, i);
+    }
+    ctx->stats.remap += ciq_seconds() - start;
+    return true;
+}
 
-    printf("Quantizing image %s with K=%d\n", input, K);
+// KCIQ: write the quantized image as RGB triples
+bool ciq_render(Context * ctx, unsigned char * rgb) {
+    if (!ctx) return false;
+    double start = ciq_seconds();
+    if (!ciq_finish(ctx)) return false;
+    for (long i = 0; i < ctx->size; i++, rgb += 3) {
+        Centroid c = ctx->centroids[ciq_pixel_index(ctx, i)];
+        rgb[0] = c.r;
+        rgb[1] = c.g;
+        rgb[2] = c.b;
+    }
+    ctx->stats.remap += ciq_seconds() - start;
+    return true;
+}
 
-    if (!ciq_quanization(input, output, K)) {
-        fprintf(stderr, "Failed to quantize image\n");
-        return 1;
+// KCIQ: write the palette index of count RGB triples from any image
+bool ciq_map(Context * ctx, const unsigned char * rgb, long count, void * indices) {
+    if (!ctx) return false;
+    double start = ciq_seconds();
+    if (!ciq_build_lut(ctx, ctx->lut_bits > 0 ? ctx->lut_bits : LUT_BITS))
+        return false;
+    for (long i = 0; i < count; i++, rgb += 3) {
+        int j = ciq_lut_lookup(ctx->lut, rgb[0], rgb[1], rgb[2]);
+        if (ctx->label_size == 1)
+            ((unsigned char *) indices)[i] = (unsigned char) j;
+        else
+            ((unsigned short *) indices)[i] = (unsigned short) j;
     }
+    ctx->stats.remap += ciq_seconds() - start;
+    return true;
+}
+
+// KCIQ: get the timings and counters of the last image
+bool ciq_stats(const Context * ctx, Stats * stats) {
+    if (!ctx || !stats) return false;
+    *stats = ctx->stats;
+    return true;
+}
 
-    return 0;
-}
\ No newline at end of file
+// KCIQ: quantize an image in one call
+bool ciq_quantize_rgb(const unsigned char * rgb, int width, int height,
+                      const Options * opts, unsigned char * palette, void * indices) {
+    Context * ctx = ciq_init(rgb, width, height, opts);
+    if (!ctx) return false;
+    bool done = ciq_quantize(ctx) && ciq_indices(ctx, indices);
+    if (done)
+        ciq_palette(ctx, palette);
+    ciq_shutdown(ctx);
+    return done;
+}
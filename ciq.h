@@ -0,0 +1,178 @@
+// K-means++ color image quantization library
+#ifndef CIQ_H
+#define CIQ_H
+
+#include <stdbool.h>
+
+// KCIQ: only these functions are exported by the shared library
+#if defined(__GNUC__) && !defined(__DJGPP__)
+    #define CIQ_API __attribute__((visibility("default")))
+#else
+    #define CIQ_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define CIQ_MAX_K 65536     // largest number of clusters, labels are stored on 16 bits
+#define CIQ_MIN_LUT 4       // smallest inverse colormap, in bits per channel
+#define CIQ_MAX_LUT 8       // largest inverse colormap, one cell per color
+
+// KCIQ: Define the assignment algorithms
+typedef enum {
+    CIQ_LLOYD,              // brute force distances to every centroid
+    CIQ_ELKAN,              // triangle inequality pruning with per-point bounds
+    CIQ_KDTREE,             // Kanungo's filtering over a kd-tree of the colors
+    CIQ_YINYANG             // triangle inequality pruning with per-point bounds per group of centroids
+} CiqAlgorithm;
+
+// KCIQ: Define the seeding methods
+typedef enum {
+    CIQ_KMEANSPP,           // k-means++, one pass over the data per seed
+    CIQ_KMEANSPAR,          // k-means||, a few oversampling passes and a reclustering
+    CIQ_AFKMC2              // AFK-MC², Markov chains over a proposal built in one pass
+} CiqSeeding;
+
+// KCIQ: thread pool shared by several contexts, opaque to the callers
+typedef struct ciq_pool CiqPool;
+
+// KCIQ: Define quantization options
+typedef struct ciq_options {
+    int K;                  // number of clusters
+    int threads;            // number of threads, 0 for all processors
+    CiqPool * pool;         // pool shared with other contexts, NULL to start threads
+    bool histogram;         // cluster the unique colors instead of the pixels
+    CiqAlgorithm algorithm; // assignment algorithm
+    CiqSeeding seeding;     // initialization of the centroids
+    int chain;              // length of the AFK-MC² Markov chains
+    long batch;             // points per mini-batch, 0 for full Lloyd iterations
+    int batches;            // number of mini-batches
+    int lut;                // bits per channel of the inverse colormap, 4 to 8, 0 to remap with the labels
+    int deadline;           // time budget in milliseconds, 0 to run until the centroids are stable
+    int iterations;         // maximum number of iterations
+    int tolerance;          // squared centroid shift under which a centroid is stable
+    double improvement;     // stop once the SSE decreases by less than this fraction, 0 to ignore
+    unsigned long seed;     // seed of the random generator, the same seed gives the same palette
+    int restarts;           // independent seedings run concurrently, the lowest SSE is kept
+    bool verbose;           // print the progress of the iterations
+} CiqOptions;
+
+// KCIQ: quantization state of an image, opaque to the callers
+typedef struct ciq_context CiqContext;
+
+// KCIQ: Define the timings, in seconds, and counters of an iteration
+typedef struct ciq_pass {
+    double assignment;      // assigning the points to the centroids
+    double update;          // moving the centroids
+    long long evaluations;  // distances computed
+    long long changed;      // points assigned to another cluster, -1 when not tracked
+    int empty;              // clusters without any point, -1 when not tracked
+    double sse;             // sum of squared errors to the new centroids, -1 when not tracked
+} CiqPass;
+
+// KCIQ: Define the timings, in seconds, and counters of the last image
+typedef struct ciq_stats {
+    double load;            // ciq_init or ciq_reload
+    double seeding;         // initial centroids
+    double assignment;      // all the assignment passes
+    double update;          // all the centroid updates
+    double remap;           // final labels, inverse colormap and output pixels
+    long long evaluations;  // distances computed by the iterations
+    long long changed;      // points reassigned over the iterations, -1 when not tracked
+    int passes;             // iterations, or mini-batches
+    const CiqPass * pass;   // each of them, valid until the next ciq_quantize
+    CiqAlgorithm algorithm; // assignment algorithm that ran
+    bool fallback;          // the requested one ran out of memory, brute force took over
+} CiqStats;
+
+// KCIQ: create a pool of threads threads, 0 for all processors
+// A shared pool starts no thread: the caller runs one context per thread and
+// lends the threads back through ciq_pool_serve once it is out of images, so
+// every chunk of work is picked up by whichever thread is idle. At most
+// threads threads take part at once: the threads lent beyond them wait in
+// ciq_pool_serve for one to leave, and a context whose thread finds no place
+// left runs its passes alone, so lending more threads is safe but useless.
+CIQ_API CiqPool * ciq_pool_create(int threads, bool shared);
+
+// KCIQ: work on the jobs of the other threads until ciq_pool_stop
+CIQ_API void ciq_pool_serve(CiqPool * pool);
+
+// KCIQ: make the threads serving the pool return
+CIQ_API void ciq_pool_stop(CiqPool * pool);
+
+// KCIQ: release the pool, after the contexts using it
+CIQ_API void ciq_pool_destroy(CiqPool * pool);
+
+// KCIQ: fill the options with their defaults
+CIQ_API void ciq_options(CiqOptions * opts);
+
+// KCIQ: name of an algorithm or a seeding, as taken by the parsers below
+CIQ_API const char * ciq_algorithm_name(CiqAlgorithm algorithm);
+CIQ_API const char * ciq_seeding_name(CiqSeeding seeding);
+
+// KCIQ: find an algorithm or a seeding by name, false for an unknown one
+CIQ_API bool ciq_parse_algorithm(const char * name, CiqAlgorithm * algorithm);
+CIQ_API bool ciq_parse_seeding(const char * name, CiqSeeding * seeding);
+
+// KCIQ: wall clock time in seconds, the clock of the timings of ciq_stats
+CIQ_API double ciq_seconds(void);
+
+// KCIQ: prepare the quantization of width * height RGB triples
+// The pixels are copied, the caller keeps ownership of rgb. Returns NULL for
+// options out of range, such as a negative count or a K above 65536.
+CIQ_API CiqContext * ciq_init(const unsigned char * rgb, int width, int height, const CiqOptions * opts);
+
+// KCIQ: load another image into a context, with the same options
+// The buffers, scratch memory and threads of the context are reused, so a
+// run of images of the same size does not allocate.
+CIQ_API bool ciq_reload(CiqContext * ctx, const unsigned char * rgb, int width, int height);
+
+// KCIQ: compute the palette
+// With a deadline, the seeding takes at most half of it and the iterations
+// stop early enough for ciq_indices, ciq_render or ciq_map to finish within it.
+// The first full iteration, or the labeling after the mini-batches, always
+// runs, so a deadline shorter than one pass over the pixels is overrun. With
+// mini-batches and a tight deadline no batch may run, the palette is then the
+// seeds. An inverse colormap is charged K distances per cell and built coarser
+// when the requested one would end past the deadline. The budget starts here:
+// the loading and the kd-tree build of ciq_init and ciq_reload are not in it.
+// With restarts, the palette is the one of the seeding with the lowest SSE.
+// The restarts share the deadline: each seeding takes at most half of the
+// budget without going past it, and the restarts that have not started by the
+// deadline are skipped, the first one always runs. With fewer threads than
+// restarts, the last ones may thus be skipped.
+CIQ_API bool ciq_quantize(CiqContext * ctx);
+
+// KCIQ: copy the palette as K RGB triples, returns K, palette may be NULL
+CIQ_API int ciq_palette(const CiqContext * ctx, unsigned char * palette);
+
+// KCIQ: size in bytes of a palette index, 1 up to K=256 else 2
+CIQ_API int ciq_index_size(const CiqContext * ctx);
+
+// KCIQ: write the palette index of every pixel
+CIQ_API bool ciq_indices(CiqContext * ctx, void * indices);
+
+// KCIQ: write the quantized image as RGB triples
+CIQ_API bool ciq_render(CiqContext * ctx, unsigned char * rgb);
+
+// KCIQ: write the palette index of count RGB triples from any image
+// The colors go through the inverse colormap, built on the first call.
+CIQ_API bool ciq_map(CiqContext * ctx, const unsigned char * rgb, long count, void * indices);
+
+// KCIQ: get the timings and counters of the last image
+CIQ_API bool ciq_stats(const CiqContext * ctx, CiqStats * stats);
+
+// KCIQ: release the context
+CIQ_API void ciq_shutdown(CiqContext * ctx);
+
+// KCIQ: quantize an image in one call, palette holds K triples and
+// indices one entry of ciq_index_size bytes per pixel
+CIQ_API bool ciq_quantize_rgb(const unsigned char * rgb, int width, int height,
+                              const CiqOptions * opts, unsigned char * palette, void * indices);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
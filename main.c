@@ -0,0 +1,757 @@
+// Command line front end of the K-means++ color quantization library
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "ciq.h"
+
+// Uncomment the following line to enable debug mode
+// #define __DEBUG__
+#define BLOCK_SIZE (1 << 20)    // bytes per read when the input is not mapped
+
+// KCIQ: input files are memory-mapped on POSIX systems
+#if !defined(__DJGPP__) && (defined(__unix__) || defined(__APPLE__)) && !defined(CIQ_NO_MMAP)
+    #define CIQ_MMAP
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+// KCIQ: a batch is spread over several threads everywhere but on DOS
+#if !defined(__DJGPP__) && !defined(CIQ_NO_THREADS)
+    #define CIQ_THREADS
+    #include <pthread.h>
+    #include <unistd.h>
+#endif
+
+// KCIQ: batch patterns are expanded on POSIX systems
+#if !defined(__DJGPP__) && (defined(__unix__) || defined(__APPLE__))
+    #define CIQ_GLOB
+    #include <glob.h>
+#endif
+
+// KCIQ: progress messages, moved to stderr when the statistics take stdout
+static FILE * report;
+
+// KCIQ: Define an input file, mapped in memory or read at once
+typedef struct reader {
+    const unsigned char * data; // bytes of the file
+    long length;                // number of bytes
+    long offset;                // position of the next byte to decode
+    unsigned char * block;      // read buffer
+    void * map;                 // mapped file
+    long mapped;                // size of the mapping
+} Reader;
+
+// KCIQ: Define an output file, rendered in memory and written at once
+typedef struct writer {
+    FILE * file;                // NULL when the file is mapped
+    unsigned char * data;       // bytes to write
+    long length;                // number of bytes to write
+    void * map;                 // mapped file
+} Writer;
+
+// KCIQ: Define a batch of images, handed out one at a time to the threads
+typedef struct batch {
+    char ** inputs;             // input file of each image
+    char ** outputs;            // output file of each image
+    int count;                  // number of images
+    int capacity;               // number of images allocated
+    int next;                   // next image to hand out
+    int active;                 // threads still quantizing images
+    int done;                   // images quantized
+    double pixels;              // pixels quantized
+    FILE * stats;               // statistics of each image, NULL for none
+    CiqOptions opts;            // options of the contexts, with the shared pool
+#ifdef CIQ_THREADS
+    pthread_mutex_t lock;
+#endif
+} Batch;
+
+// KCIQ: open a file for reading, mapped in memory when possible
+static bool ciq_reader_open(Reader * in, const char * filename) {
+    memset(in, 0, sizeof(Reader));
+#ifdef CIQ_MMAP
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void * map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            in->map = map;
+            in->mapped = st.st_size;
+            in->data = (const unsigned char *) map;
+            in->length = st.st_size;
+            close(fd);
+            return true;
+        }
+    }
+    close(fd);      // not mappable, read it instead
+#endif
+    // the library takes the pixels in a single buffer, read the whole file
+    FILE * file = fopen(filename, "rb");
+    if (!file) return false;
+    long capacity = BLOCK_SIZE;
+    in->block = (unsigned char *) malloc(capacity);
+    while (in->block) {
+        in->length += fread(in->block + in->length, 1, capacity - in->length, file);
+        if (in->length < capacity)
+            break;
+        unsigned char * grown = (unsigned char *) realloc(in->block, 2 * capacity);
+        if (!grown) {
+            free(in->block);
+            in->block = NULL;
+        }
+        else {
+            in->block = grown;
+            capacity *= 2;
+        }
+    }
+    fclose(file);
+    in->data = in->block;
+    return in->block != NULL;
+}
+
+// KCIQ: close an input file
+static void ciq_reader_close(Reader * in) {
+#ifdef CIQ_MMAP
+    if (in->map) munmap(in->map, in->mapped);
+#endif
+    if (in->block) free(in->block);
+}
+
+// KCIQ: read a number of the PPM header, skipping blanks and comments
+static int ciq_reader_number(Reader * in) {
+    int value = -1;
+    while (in->offset < in->length) {
+        int c = in->data[in->offset];
+        if (c == '#') {
+            while (in->offset < in->length && in->data[in->offset] != '\n')
+                in->offset++;
+        }
+        else if (isspace(c))
+            in->offset++;
+        else
+            break;
+    }
+    while (in->offset < in->length && isdigit(in->data[in->offset])) {
+        int digit = in->data[in->offset++] - '0';
+        if (value > (0x7fffffff - digit) / 10) return -1;
+        value = (value < 0 ? 0 : value * 10) + digit;
+    }
+    return value;
+}
+
+// KCIQ: create a file of the given length and return its memory
+// The file is mapped with CIQ_MMAP_OUTPUT, otherwise it is buffered and
+// written with a single call when closed.
+static unsigned char * ciq_writer_open(Writer * out, const char * filename, long length) {
+    memset(out, 0, sizeof(Writer));
+    out->length = length;
+#if defined(CIQ_MMAP) && defined(CIQ_MMAP_OUTPUT)
+    int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return NULL;
+    if (ftruncate(fd, length) == 0) {
+        void * map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            out->map = map;
+            out->data = (unsigned char *) map;
+            close(fd);
+            return out->data;
+        }
+    }
+    close(fd);      // not mappable, buffer it instead
+#endif
+    out->file = fopen(filename, "wb");
+    out->data = (unsigned char *) malloc(length);
+    if (!out->file || !out->data) {
+        if (out->file) fclose(out->file);
+        if (out->data) free(out->data);
+        return NULL;
+    }
+    return out->data;
+}
+
+// KCIQ: write the file and release its memory
+static bool ciq_writer_close(Writer * out) {
+#ifdef CIQ_MMAP
+    if (out->map) {
+        munmap(out->map, out->length);
+        return true;
+    }
+#endif
+    bool done = fwrite(out->data, 1, out->length, out->file) == (size_t) out->length;
+    done = fclose(out->file) == 0 && done;
+    free(out->data);
+    return done;
+}
+
+// KCIQ: open a binary PPM file and return its RGB triples
+static const unsigned char * ciq_load(Reader * in, const char * filename, int * width, int * height) {
+    if (!ciq_reader_open(in, filename)) {
+#ifdef __DEBUG__
+        fprintf(stderr, "Unable to open file %s\n", filename);
+#endif
+        return NULL;
+    }
+
+    // Read PPM header
+    int maxval = -1;
+    bool binary = in->length >= 2 && in->data[0] == 'P' && in->data[1] == '6';
+    *width = *height = -1;
+    if (binary) {
+        in->offset = 2;
+        *width = ciq_reader_number(in);
+        *height = ciq_reader_number(in);
+        maxval = ciq_reader_number(in);
+        in->offset++;   // single whitespace before the pixels
+    }
+
+    if (!binary || *width <= 0 || *height <= 0 || maxval != 255) {
+#ifdef __DEBUG__
+        fprintf(stderr, "Unsupported PPM format\n");
+#endif
+        ciq_reader_close(in);
+        return NULL;
+    }
+    if (in->length - in->offset < 3L * *width * *height) {
+#ifdef __DEBUG__
+        fprintf(stderr, "Truncated PPM file\n");
+#endif
+        ciq_reader_close(in);
+        return NULL;
+    }
+    return in->data + in->offset;
+}
+
+// KCIQ: write the quantized image and its palette
+static bool ciq_save(CiqContext * ctx, const char * filename, const char * palette, int width, int height) {
+    Writer out;
+    char header[64];
+    int length = sprintf(header, "P6\n%d %d\n255\n", width, height);
+    long size = 3L * width * height;
+#ifdef __DEBUG__
+    double start = ciq_seconds();
+#endif
+
+    unsigned char * rgb = ciq_writer_open(&out, filename, length + size);
+    if (!rgb) {
+#ifdef __DEBUG__
+        fprintf(stderr, "Unable to create file %s\n", filename);
+#endif
+        return false;
+    }
+
+    // render the whole image in memory
+    memcpy(rgb, header, length);
+    if (!ciq_render(ctx, rgb + length)) {
+        ciq_writer_close(&out);
+        return false;
+    }
+
+    if (!ciq_writer_close(&out)) {
+#ifdef __DEBUG__
+        fprintf(stderr, "Unable to write file %s\n", filename);
+#endif
+        return false;
+    }
+#ifdef __DEBUG__
+    fprintf(report, "- Saved %ld bytes in %.2f ms\n", length + size, 1000 * (ciq_seconds() - start));
+#endif
+
+    // write the palette file
+    int K = ciq_palette(ctx, NULL);
+    rgb = ciq_writer_open(&out, palette, 3 * K);
+    if (!rgb) {
+#ifdef __DEBUG__
+        fprintf(stderr, "Unable to create file %s\n", palette);
+#endif
+        return false;
+    }
+    ciq_palette(ctx, rgb);
+    return ciq_writer_close(&out);
+}
+
+// KCIQ: write a file name as a JSON string
+static void ciq_json_string(FILE * file, const char * text) {
+    fputc('"', file);
+    for (; *text; text++) {
+        if (*text == '"' || *text == '\\')
+            fputc('\\', file);
+        if ((unsigned char) *text >= 0x20)
+            fputc(*text, file);
+    }
+    fputc('"', file);
+}
+
+// KCIQ: write a counter as JSON, null when it is not tracked
+static void ciq_json_count(FILE * file, const char * name, double value) {
+    if (value < 0)
+        fprintf(file, ",\"%s\":null", name);
+    else
+        fprintf(file, ",\"%s\":%.0f", name, value);
+}
+
+// KCIQ: append the statistics of an image to a JSON lines file
+// Times are in milliseconds, total covers reading to writing the files.
+static void ciq_write_stats(FILE * file, CiqContext * ctx, const char * input, int width, int height,
+                            const CiqOptions * opts, double total) {
+    CiqStats s;
+    if (!ciq_stats(ctx, &s)) return;
+
+    fprintf(file, "{\"input\":");
+    ciq_json_string(file, input);
+    fprintf(file, ",\"width\":%d,\"height\":%d,\"K\":%d,\"algorithm\":\"%s\",\"init\":\"%s\"",
+            width, height, opts->K, opts->batch > 0 ? "minibatch" : ciq_algorithm_name(s.algorithm),
+            ciq_seeding_name(opts->seeding));
+    fprintf(file, ",\"fallback\":%s", s.fallback ? "true" : "false");
+    fprintf(file, ",\"load_ms\":%.3f,\"seeding_ms\":%.3f,\"assignment_ms\":%.3f"
+                  ",\"update_ms\":%.3f,\"remap_ms\":%.3f,\"total_ms\":%.3f",
+            1000 * s.load, 1000 * s.seeding, 1000 * s.assignment, 1000 * s.update,
+            1000 * s.remap, 1000 * total);
+    fprintf(file, ",\"iterations\":%d", s.passes);
+    ciq_json_count(file, "evaluations", (double) s.evaluations);
+    ciq_json_count(file, "changed", (double) s.changed);
+    fprintf(file, ",\"passes\":[");
+    for (int i = 0; i < s.passes; i++) {
+        const CiqPass * p = &s.pass[i];
+        fprintf(file, "%s{\"assignment_ms\":%.3f,\"update_ms\":%.3f", i ? "," : "",
+                1000 * p->assignment, 1000 * p->update);
+        ciq_json_count(file, "evaluations", (double) p->evaluations);
+        ciq_json_count(file, "changed", (double) p->changed);
+        ciq_json_count(file, "empty", p->empty);
+        ciq_json_count(file, "sse", p->sse);
+        fputc('}', file);
+    }
+    fprintf(file, "]}\n");
+    fflush(file);
+}
+
+// KCIQ: main function for image quantization
+static bool ciq_quanization(const char * input, const char * output, const CiqOptions * opts, FILE * stats) {
+    Reader in;
+    int width, height;
+    double start = ciq_seconds();
+    const unsigned char * rgb = ciq_load(&in, input, &width, &height);
+    if (!rgb)
+        return false;
+
+    // the context keeps its own copy of the pixels
+    CiqContext * ctx = ciq_init(rgb, width, height, opts);
+    ciq_reader_close(&in);
+    if (!ctx) {
+#ifdef __DEBUG__
+        fprintf(stderr, "Failed to initialize context\n");
+#endif        
+        return false;
+    }
+#ifdef __DEBUG__
+    double elapsed = ciq_seconds() - start;
+    fprintf(report, "- Loaded %ld bytes in %.2f ms (%.1f MB/s)\n", 3L * width * height, 1000 * elapsed,
+           3.0 * width * height / (elapsed > 0 ? elapsed : 1.0e-9) / 1.0e6);
+#endif
+
+    bool done = ciq_quantize(ctx) && ciq_save(ctx, output, "palette.pal", width, height);
+    if (done && stats)
+        ciq_write_stats(stats, ctx, input, width, height, opts, ciq_seconds() - start);
+    if (done) {
+#ifdef __DEBUG__
+        fprintf(report, "Image quantized successfully and saved into %s\n", output);
+#endif        
+    } else {
+#ifdef  __DEBUG__        
+        fprintf(stderr, "Failed to quantize image\n");
+#endif        
+    }
+    ciq_shutdown(ctx);
+    return done;
+}
+
+// KCIQ: name a file after another one, with its extension replaced
+static char * ciq_rename(const char * filename, const char * extension) {
+    const char * dot = strrchr(filename, '.');
+    const char * slash = strrchr(filename, '/');
+    size_t length = dot && (!slash || dot > slash) ? (size_t) (dot - filename) : strlen(filename);
+    char * name = (char *) malloc(length + strlen(extension) + 1);
+    if (!name) return NULL;
+    memcpy(name, filename, length);
+    strcpy(name + length, extension);
+    return name;
+}
+
+// KCIQ: append an image to the batch, written to input.q.ppm without an output
+static bool ciq_batch_add(Batch * b, const char * input, const char * output) {
+    if (b->count == b->capacity) {
+        int capacity = b->capacity ? 2 * b->capacity : 64;
+        char ** inputs = (char **) realloc(b->inputs, capacity * sizeof(char *));
+        if (!inputs) return false;
+        b->inputs = inputs;
+        char ** outputs = (char **) realloc(b->outputs, capacity * sizeof(char *));
+        if (!outputs) return false;
+        b->outputs = outputs;
+        b->capacity = capacity;
+    }
+    b->inputs[b->count] = strdup(input);
+    b->outputs[b->count] = output ? strdup(output) : ciq_rename(input, ".q.ppm");
+    if (!b->inputs[b->count] || !b->outputs[b->count]) {
+        free(b->inputs[b->count]);
+        free(b->outputs[b->count]);
+        return false;
+    }
+    b->count++;
+    return true;
+}
+
+// KCIQ: list the images of a batch, from a pattern or a manifest
+// A manifest holds one image per line, the input file then optionally the
+// output file. Blank lines and lines starting with # are skipped.
+static bool ciq_batch_open(Batch * b, const char * list) {
+    memset(b, 0, sizeof(Batch));
+
+#ifdef CIQ_GLOB
+    if (strpbrk(list, "*?[")) {
+        glob_t found;
+        bool done = glob(list, 0, NULL, &found) == 0;
+        for (size_t i = 0; done && i < found.gl_pathc; i++) {
+            // skip the outputs of a previous run
+            const char * name = found.gl_pathv[i];
+            size_t length = strlen(name);
+            if (length < 6 || strcmp(name + length - 6, ".q.ppm") != 0)
+                done = ciq_batch_add(b, name, NULL);
+        }
+        globfree(&found);
+        return done;
+    }
+#endif
+
+    FILE * file = fopen(list, "r");
+    if (!file) return false;
+    char line[4096], input[4096], output[4096];
+    bool done = true;
+    while (done && fgets(line, sizeof(line), file)) {
+        int fields = sscanf(line, "%4095s %4095s", input, output);
+        if (fields < 1 || input[0] == '#')
+            continue;
+        done = ciq_batch_add(b, input, fields > 1 ? output : NULL);
+    }
+    fclose(file);
+    return done;
+}
+
+// KCIQ: free the list of images
+static void ciq_batch_close(Batch * b) {
+    for (int i = 0; i < b->count; i++) {
+        free(b->inputs[i]);
+        free(b->outputs[i]);
+    }
+    free(b->inputs);
+    free(b->outputs);
+}
+
+// KCIQ: hand out the next image of the batch, -1 when there is none left
+static int ciq_batch_next(Batch * b) {
+    int next = -1;
+#ifdef CIQ_THREADS
+    pthread_mutex_lock(&b->lock);
+#endif
+    if (b->next < b->count)
+        next = b->next++;
+#ifdef CIQ_THREADS
+    pthread_mutex_unlock(&b->lock);
+#endif
+    return next;
+}
+
+// KCIQ: quantize images of the batch until there is none left
+// Each thread reuses its context from one image to the next. The chunks of
+// every image go through the shared pool, so a thread out of images, or one
+// waiting on its own chunks, works on the images of the other threads.
+static void * ciq_batch_worker(void * arg) {
+    Batch * b = (Batch *) arg;
+    CiqContext * ctx = NULL;
+    int i;
+
+    while ((i = ciq_batch_next(b)) >= 0) {
+        Reader in;
+        int width, height;
+        bool done = false;
+        double start = ciq_seconds();
+        const unsigned char * rgb = ciq_load(&in, b->inputs[i], &width, &height);
+        if (rgb) {
+            if (ctx)
+                done = ciq_reload(ctx, rgb, width, height);
+            else
+                done = (ctx = ciq_init(rgb, width, height, &b->opts)) != NULL;
+            ciq_reader_close(&in);
+        }
+
+        char * palette = ciq_rename(b->outputs[i], ".pal");
+        done = done && palette && ciq_quantize(ctx) &&
+               ciq_save(ctx, b->outputs[i], palette, width, height);
+        free(palette);
+
+#ifdef CIQ_THREADS
+        pthread_mutex_lock(&b->lock);
+#endif
+        if (done) {
+            b->done++;
+            b->pixels += (double) width * height;
+            if (b->stats)
+                ciq_write_stats(b->stats, ctx, b->inputs[i], width, height, &b->opts,
+                                ciq_seconds() - start);
+            fprintf(report, "%s -> %s (%dx%d)\n", b->inputs[i], b->outputs[i], width, height);
+        } else
+            fprintf(stderr, "Failed to quantize image %s\n", b->inputs[i]);
+#ifdef CIQ_THREADS
+        pthread_mutex_unlock(&b->lock);
+#endif
+    }
+    ciq_shutdown(ctx);
+
+#ifdef CIQ_THREADS
+    // lend the thread to the images still being quantized
+    pthread_mutex_lock(&b->lock);
+    bool last = --b->active == 0;
+    pthread_mutex_unlock(&b->lock);
+    if (last)
+        ciq_pool_stop(b->opts.pool);
+    else
+        ciq_pool_serve(b->opts.pool);
+#endif
+    return NULL;
+}
+
+// KCIQ: quantize a batch of images with a thread per image in flight
+// Threads beyond the number of images serve the pool from the start, so a
+// few large images still use every thread.
+static bool ciq_batch(const char * list, const CiqOptions * opts, FILE * stats) {
+    Batch b;
+    if (!ciq_batch_open(&b, list) || b.count == 0) {
+        fprintf(stderr, "No image to quantize in %s\n", list);
+        ciq_batch_close(&b);
+        return false;
+    }
+
+    int threads = 1;
+#ifdef CIQ_THREADS
+    threads = opts->threads > 0 ? opts->threads : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0)
+        threads = 1;
+#endif
+    b.stats = stats;
+    b.opts = *opts;
+    b.opts.verbose = false;
+    b.opts.pool = ciq_pool_create(threads, true);
+    if (!b.opts.pool) {
+        ciq_batch_close(&b);
+        return false;
+    }
+    fprintf(report, "Quantizing %d images with K=%d on %d threads\n", b.count, opts->K, threads);
+
+    double start = ciq_seconds();
+#ifdef CIQ_THREADS
+    pthread_t * workers = (pthread_t *) malloc(threads * sizeof(pthread_t));
+    int started = 0;
+    pthread_mutex_init(&b.lock, NULL);
+    b.active = threads;
+    // the calling thread is the first one
+    while (workers && started + 1 < threads &&
+           pthread_create(&workers[started], NULL, ciq_batch_worker, &b) == 0)
+        started++;
+    pthread_mutex_lock(&b.lock);
+    b.active -= threads - 1 - started;
+    pthread_mutex_unlock(&b.lock);
+    ciq_batch_worker(&b);
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    pthread_mutex_destroy(&b.lock);
+#else
+    ciq_batch_worker(&b);
+#endif
+    double elapsed = ciq_seconds() - start;
+    if (elapsed <= 0)
+        elapsed = 1.0e-9;
+
+    fprintf(report, "Quantized %d of %d images, %.1f MP in %.2f s: %.2f images/s, %.2f MP/s\n",
+           b.done, b.count, b.pixels / 1.0e6, elapsed, b.done / elapsed, b.pixels / 1.0e6 / elapsed);
+    ciq_pool_destroy(b.opts.pool);
+    bool done = b.done == b.count;
+    ciq_batch_close(&b);
+    return done;
+}
+
+int main(int argc, char *argv[]) {
+    CiqOptions opts;
+    ciq_options(&opts);
+    opts.verbose = true;
+    const char * files[2];
+    const char * batch = NULL;
+    const char * stats = NULL;
+    int count = 0;
+    bool sized = false, invalid = false;
+
+    // parse the options, the remaining arguments are positional
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            opts.threads = atoi(argv[++i]);
+            if (opts.threads < 0) {
+                fprintf(stderr, "Invalid number of threads %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--chain") == 0 && i + 1 < argc) {
+            opts.chain = atoi(argv[++i]);
+            if (opts.chain < 1) {
+                fprintf(stderr, "Invalid chain length %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--minibatch") == 0 && i + 1 < argc) {
+            opts.batch = atol(argv[++i]);
+            if (opts.batch < 0) {
+                fprintf(stderr, "Invalid mini-batch size %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--batches") == 0 && i + 1 < argc) {
+            opts.batches = atoi(argv[++i]);
+            if (opts.batches < 1) {
+                fprintf(stderr, "Invalid number of mini-batches %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--lut") == 0 && i + 1 < argc) {
+            opts.lut = atoi(argv[++i]);
+            if (opts.lut != 0 && (opts.lut < CIQ_MIN_LUT || opts.lut > CIQ_MAX_LUT)) {
+                fprintf(stderr, "The inverse colormap needs %d to %d bits per channel\n",
+                        CIQ_MIN_LUT, CIQ_MAX_LUT);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--iters") == 0 && i + 1 < argc) {
+            opts.iterations = atoi(argv[++i]);
+            if (opts.iterations < 0) {
+                fprintf(stderr, "Invalid number of iterations %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc) {
+            opts.tolerance = atoi(argv[++i]);
+            if (opts.tolerance < 0) {
+                fprintf(stderr, "Invalid tolerance %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--improvement") == 0 && i + 1 < argc) {
+            opts.improvement = atof(argv[++i]);
+            if (opts.improvement < 0) {
+                fprintf(stderr, "Invalid improvement %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--deadline") == 0 && i + 1 < argc) {
+            opts.deadline = atoi(argv[++i]);
+            if (opts.deadline < 0) {
+                fprintf(stderr, "Invalid deadline %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            opts.seed = strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--restarts") == 0 && i + 1 < argc) {
+            opts.restarts = atoi(argv[++i]);
+            if (opts.restarts < 0) {
+                fprintf(stderr, "Invalid number of restarts %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc)
+            stats = argv[++i];
+        else if (strcmp(argv[i], "--histogram") == 0)
+            opts.histogram = true;
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+            batch = argv[++i];
+        else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            if (!ciq_parse_algorithm(argv[++i], &opts.algorithm)) {
+                fprintf(stderr, "Unknown algorithm %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[i], "--init") == 0 && i + 1 < argc) {
+            if (!ciq_parse_seeding(argv[++i], &opts.seeding)) {
+                fprintf(stderr, "Unknown initialization %s\n", argv[i]);
+                return 1;
+            }
+        }
+        else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            // unknown option, or an option missing its value
+            fprintf(stderr, "Invalid option %s\n", argv[i]);
+            invalid = true;
+            break;
+        }
+        else if (count < 2 && !batch)
+            files[count++] = argv[i];
+        else {
+            char * end;
+            long K = strtol(argv[i], &end, 10);
+            if (sized || end == argv[i] || *end) {
+                fprintf(stderr, "Invalid number of colors %s\n", argv[i]);
+                return 1;
+            }
+            if (K < 1 || K > CIQ_MAX_K) {
+                fprintf(stderr, "The number of colors must be between 1 and %d\n", CIQ_MAX_K);
+                return 1;
+            }
+            opts.K = (int) K;
+            sized = true;
+        }
+    }
+
+    // the JSON lines alone on stdout, the rest goes to stderr
+    bool piped = stats && strcmp(stats, "-") == 0;
+    report = piped ? stderr : stdout;
+    if (piped)
+        opts.verbose = false;
+    fprintf(report, "Color Image Quantization using K-Means++ - v0.1\n");
+
+    if (invalid || (batch ? count > 0 : count < 2)) {
+        fprintf(stderr, "Usage: %s [-j threads] [-a lloyd|elkan|kdtree|yinyang] [--init kmeans++|kmeans|||afkmc2] [--chain M] [--minibatch B] [--batches T] [--lut bits] [--iters N] [--tolerance D] [--improvement F] [--deadline ms] [--seed N] [--restarts N] [--stats file] [--histogram] <input.ppm> <output.ppm> [K]\n", argv[0]);
+        fprintf(stderr, "       %s [options] --batch <manifest|pattern> [K]\n", argv[0]);
+        return 1;
+    }
+
+    // statistics as JSON lines appended to the file, to the standard output for -
+    FILE * file = NULL;
+    if (stats) {
+        file = piped ? stdout : fopen(stats, "a");
+        if (!file) {
+            fprintf(stderr, "Unable to create file %s\n", stats);
+            return 1;
+        }
+    }
+    if (batch) {
+        bool done = ciq_batch(batch, &opts, file);
+        if (file && file != stdout)
+            fclose(file);
+        return done ? 0 : 1;
+    }
+
+    const char * input = files[0];
+    const char * output = files[1];
+
+    fprintf(report, "Quantizing image %s with K=%d\n", input, opts.K);
+
+    bool done = ciq_quanization(input, output, &opts, file);
+    if (file && file != stdout)
+        fclose(file);
+    if (!done) {
+        fprintf(stderr, "Failed to quantize image\n");
+        return 1;
+    }
+
+    return 0;
+}
\ No newline at end of file